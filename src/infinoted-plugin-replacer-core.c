@@ -0,0 +1,734 @@
+/*
+ * infinoted-plugin-replacer - a real-time replacer for text sessions
+ * on an infinoted server.
+ * Copyright (C) 2016 Pietro Brenna <pietrobrenna@zoho.com>
+ * Copyright (C) 2016 Alessandro Bregoli <>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+*/
+
+/* The part of the replacer which works on a single text buffer, shared by
+ * the plugin and by infinoted-replacer-replay. */
+
+#include "infinoted-plugin-replacer-core.h"
+
+#include <string.h>
+
+/* Minimum distance in bytes between two checkpoints of the scratch text.
+ * Both can be overridden, for infinoted-replacer-check to exercise the
+ * checkpoints on small documents. */
+#ifndef INFINOTED_PLUGIN_REPLACER_CHECKPOINT_STRIDE
+#define INFINOTED_PLUGIN_REPLACER_CHECKPOINT_STRIDE 4096
+#endif
+/* Number of checkpoints after which the stride is doubled */
+#ifndef INFINOTED_PLUGIN_REPLACER_CHECKPOINT_MAX
+#define INFINOTED_PLUGIN_REPLACER_CHECKPOINT_MAX 4096
+#endif
+
+typedef struct _InfinotedPluginReplacerMatch InfinotedPluginReplacerMatch;
+struct _InfinotedPluginReplacerMatch {
+  guint offset; /* in characters, into the scanned text */
+  gsize index;  /* in bytes, into the scanned text */
+};
+
+/* Character offset of a position in the scratch text and its byte index */
+typedef struct _InfinotedPluginReplacerCheckpoint
+  InfinotedPluginReplacerCheckpoint;
+struct _InfinotedPluginReplacerCheckpoint {
+  guint offset;
+  gsize index;
+};
+
+void
+infinoted_plugin_replacer_latency_add(InfinotedPluginReplacerLatency* latency,
+                                      gint64 usec)
+{
+  guint64 value;
+  guint msb;
+  guint bucket;
+
+  value = MAX(usec, 0);
+  if(value < 4)
+  {
+    bucket = value;
+  }
+  else
+  {
+    msb = g_bit_storage(value) - 1;
+    bucket = 4 * (msb - 1) + ((value >> (msb - 2)) & 3);
+    bucket = MIN(bucket, INFINOTED_PLUGIN_REPLACER_LATENCY_BUCKETS - 1);
+  }
+
+  ++latency->counts[bucket];
+  ++latency->total;
+  latency->max = MAX(latency->max, usec);
+}
+
+/* Returns the upper bound of the bucket holding the given percentile */
+guint64
+infinoted_plugin_replacer_latency_percentile(
+  const InfinotedPluginReplacerLatency* latency,
+  guint percentile)
+{
+  guint64 count;
+  guint64 rank;
+  guint bucket;
+  guint msb;
+
+  rank = (latency->total * percentile + 99) / 100;
+  count = 0;
+  for(bucket = 0; bucket < INFINOTED_PLUGIN_REPLACER_LATENCY_BUCKETS; ++bucket)
+  {
+    count += latency->counts[bucket];
+    if(count >= rank)
+      break;
+  }
+
+  if(bucket < 4)
+    return bucket;
+
+  msb = bucket / 4 + 1;
+  return ((guint64)(4 + bucket % 4 + 1) << (msb - 2)) - 1;
+}
+
+void
+infinoted_plugin_replacer_scratch_init(InfinotedPluginReplacerScratch* scratch)
+{
+  scratch->text = g_string_sized_new(INFINOTED_PLUGIN_REPLACER_SCRATCH_SIZE);
+  scratch->next = g_string_sized_new(INFINOTED_PLUGIN_REPLACER_SCRATCH_SIZE);
+  scratch->matches = g_array_new(
+    FALSE,
+    FALSE,
+    sizeof(InfinotedPluginReplacerMatch)
+  );
+  scratch->checkpoints = g_array_new(
+    FALSE,
+    FALSE,
+    sizeof(InfinotedPluginReplacerCheckpoint)
+  );
+  scratch->candidates = g_array_new(FALSE, FALSE, sizeof(guint32));
+  scratch->stride = INFINOTED_PLUGIN_REPLACER_CHECKPOINT_STRIDE;
+  scratch->synced = FALSE;
+  scratch->dirty_begin = G_MAXUINT;
+  scratch->dirty_end = 0;
+  scratch->matches_peak = 0;
+  scratch->checkpoints_peak = 0;
+  scratch->initial_size = infinoted_plugin_replacer_scratch_get_size(scratch);
+}
+
+void
+infinoted_plugin_replacer_scratch_release(
+  InfinotedPluginReplacerScratch* scratch)
+{
+  g_string_free(scratch->text, TRUE);
+  g_string_free(scratch->next, TRUE);
+  g_array_free(scratch->matches, TRUE);
+  g_array_free(scratch->checkpoints, TRUE);
+  g_array_free(scratch->candidates, TRUE);
+}
+
+/* Returns the number of bytes allocated by the scratch buffers. Neither
+ * GString nor GArray give memory back when truncated, so this is what they
+ * have grown to, not what they currently hold. */
+gsize
+infinoted_plugin_replacer_scratch_get_size(
+  const InfinotedPluginReplacerScratch* scratch)
+{
+  return scratch->text->allocated_len +
+    scratch->next->allocated_len +
+    scratch->matches_peak * sizeof(InfinotedPluginReplacerMatch) +
+    scratch->checkpoints_peak * sizeof(InfinotedPluginReplacerCheckpoint) +
+    scratch->candidates->len * sizeof(guint32);
+}
+
+static void
+infinoted_plugin_replacer_scratch_load(InfinotedPluginReplacerScratch* scratch,
+                                       InfTextChunk* chunk)
+{
+  InfTextChunkIter iter;
+
+  g_string_truncate(scratch->text, 0);
+  g_array_set_size(scratch->checkpoints, 0);
+
+  if(inf_text_chunk_iter_init_begin(chunk, &iter))
+  {
+    do
+    {
+      g_string_append_len(
+        scratch->text,
+        inf_text_chunk_iter_get_text(&iter),
+        inf_text_chunk_iter_get_bytes(&iter)
+      );
+    } while(inf_text_chunk_iter_next(&iter));
+  }
+}
+
+/* Returns the byte index of the character at offset in the scratch text.
+ * The text is walked from the closest checkpoint before offset, and missing
+ * checkpoints are added on the way. */
+static gsize
+infinoted_plugin_replacer_scratch_index(InfinotedPluginReplacerScratch* scratch,
+                                        guint offset)
+{
+  InfinotedPluginReplacerCheckpoint* checkpoints;
+  InfinotedPluginReplacerCheckpoint walk;
+  gsize last_index;
+  guint lo;
+  guint hi;
+  guint mid;
+  guint i;
+  guint j;
+
+  checkpoints = (InfinotedPluginReplacerCheckpoint*)scratch->checkpoints->data;
+  lo = 0;
+  hi = scratch->checkpoints->len;
+  while(lo < hi)
+  {
+    mid = lo + (hi - lo) / 2;
+    if(checkpoints[mid].offset <= offset)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  if(lo > 0)
+  {
+    walk = checkpoints[lo - 1];
+  }
+  else
+  {
+    walk.offset = 0;
+    walk.index = 0;
+  }
+
+  last_index = walk.index;
+  while(walk.offset < offset && walk.index < scratch->text->len)
+  {
+    walk.index = g_utf8_next_char(scratch->text->str + walk.index) -
+      scratch->text->str;
+    ++walk.offset;
+
+    if(walk.index - last_index >= scratch->stride &&
+       walk.index < scratch->text->len)
+    {
+      g_array_insert_val(scratch->checkpoints, lo, walk);
+      ++lo;
+      last_index = walk.index;
+    }
+  }
+
+  if(scratch->checkpoints->len > scratch->checkpoints_peak)
+    scratch->checkpoints_peak = scratch->checkpoints->len;
+
+  /* Keep the index bounded by spreading the checkpoints further apart */
+  if(scratch->checkpoints->len > INFINOTED_PLUGIN_REPLACER_CHECKPOINT_MAX)
+  {
+    scratch->stride *= 2;
+    for(i = 1, j = 0; i < scratch->checkpoints->len; i += 2, ++j)
+    {
+      g_array_index(scratch->checkpoints, InfinotedPluginReplacerCheckpoint, j) =
+        g_array_index(scratch->checkpoints, InfinotedPluginReplacerCheckpoint, i);
+    }
+
+    g_array_set_size(scratch->checkpoints, j);
+  }
+
+  return MIN(walk.index, scratch->text->len);
+}
+
+/* Updates the checkpoints after old_len characters (old_bytes bytes) at
+ * offset have been replaced by new_len characters (new_bytes bytes).
+ * Checkpoints inside the replaced range are dropped, the ones after it
+ * are moved. */
+static void
+infinoted_plugin_replacer_scratch_shift(InfinotedPluginReplacerScratch* scratch,
+                                        guint offset,
+                                        guint old_len,
+                                        gsize old_bytes,
+                                        guint new_len,
+                                        gsize new_bytes)
+{
+  InfinotedPluginReplacerCheckpoint* checkpoint;
+  guint i;
+  guint j;
+
+  for(i = 0, j = 0; i < scratch->checkpoints->len; ++i)
+  {
+    checkpoint = &g_array_index(
+      scratch->checkpoints,
+      InfinotedPluginReplacerCheckpoint,
+      i
+    );
+
+    if(checkpoint->offset > offset)
+    {
+      if(checkpoint->offset < offset + old_len)
+        continue;
+
+      checkpoint->offset = checkpoint->offset - old_len + new_len;
+      checkpoint->index = checkpoint->index - old_bytes + new_bytes;
+    }
+
+    g_array_index(scratch->checkpoints, InfinotedPluginReplacerCheckpoint, j) =
+      *checkpoint;
+    ++j;
+  }
+
+  g_array_set_size(scratch->checkpoints, j);
+}
+
+static void
+infinoted_plugin_replacer_scratch_insert(
+  InfinotedPluginReplacerScratch* scratch,
+  guint pos,
+  InfTextChunk* chunk)
+{
+  InfTextChunkIter iter;
+  gsize index;
+  gsize bytes;
+
+  index = infinoted_plugin_replacer_scratch_index(scratch, pos);
+  bytes = 0;
+
+  if(inf_text_chunk_iter_init_begin(chunk, &iter))
+  {
+    do
+    {
+      g_string_insert_len(
+        scratch->text,
+        index + bytes,
+        inf_text_chunk_iter_get_text(&iter),
+        inf_text_chunk_iter_get_bytes(&iter)
+      );
+
+      bytes += inf_text_chunk_iter_get_bytes(&iter);
+    } while(inf_text_chunk_iter_next(&iter));
+  }
+
+  infinoted_plugin_replacer_scratch_shift(
+    scratch,
+    pos,
+    0,
+    0,
+    inf_text_chunk_get_length(chunk),
+    bytes
+  );
+}
+
+static void
+infinoted_plugin_replacer_scratch_erase(InfinotedPluginReplacerScratch* scratch,
+                                        guint pos,
+                                        InfTextChunk* chunk)
+{
+  InfTextChunkIter iter;
+  gsize index;
+  gsize bytes;
+
+  index = infinoted_plugin_replacer_scratch_index(scratch, pos);
+  bytes = 0;
+
+  if(inf_text_chunk_iter_init_begin(chunk, &iter))
+  {
+    do
+    {
+      bytes += inf_text_chunk_iter_get_bytes(&iter);
+    } while(inf_text_chunk_iter_next(&iter));
+  }
+
+  g_string_erase(scratch->text, index, bytes);
+
+  infinoted_plugin_replacer_scratch_shift(
+    scratch,
+    pos,
+    inf_text_chunk_get_length(chunk),
+    bytes,
+    0,
+    0
+  );
+}
+
+/* Finds the occurrences of key between the byte indices begin and end of
+ * the scratch text. Match offsets are relative to begin. */
+static void
+infinoted_plugin_replacer_scratch_scan(InfinotedPluginReplacerScratch* scratch,
+                                       gsize begin,
+                                       gsize end,
+                                       const gchar* key,
+                                       gsize key_slen,
+                                       glong key_ulen)
+{
+  InfinotedPluginReplacerMatch match;
+  const gchar* text;
+  const gchar* prev;
+  const gchar* found;
+
+  g_array_set_size(scratch->matches, 0);
+
+  text = scratch->text->str;
+  prev = text + begin;
+  match.offset = 0;
+
+  while(NULL != (found = g_strstr_len(prev, text + end - prev, key)))
+  {
+    /* Count characters from the previous match only, instead of from the
+     * start of the text for every match. */
+    match.offset += g_utf8_strlen(prev, found - prev);
+    match.index = found - text;
+    g_array_append_val(scratch->matches, match);
+
+    match.offset += key_ulen;
+    prev = found + key_slen;
+  }
+
+  if(scratch->matches->len > scratch->matches_peak)
+    scratch->matches_peak = scratch->matches->len;
+}
+
+/* Mirrors the replacements done in the buffer, so that the next pass does
+ * not need to read the buffer again. offset is the character offset the
+ * matches are relative to. */
+static void
+infinoted_plugin_replacer_scratch_apply(InfinotedPluginReplacerScratch* scratch,
+                                        guint offset,
+                                        gsize key_slen,
+                                        glong key_ulen,
+                                        const gchar* val,
+                                        gsize val_slen,
+                                        glong val_ulen)
+{
+  InfinotedPluginReplacerMatch* first;
+  InfinotedPluginReplacerMatch* last;
+  InfinotedPluginReplacerMatch* match;
+  gsize index;
+  gsize end;
+  guint i;
+
+  first = &g_array_index(scratch->matches, InfinotedPluginReplacerMatch, 0);
+  last = &g_array_index(
+    scratch->matches,
+    InfinotedPluginReplacerMatch,
+    scratch->matches->len - 1
+  );
+
+  /* Only the text between the first and the last match is rebuilt */
+  g_string_truncate(scratch->next, 0);
+  index = first->index;
+  end = last->index + key_slen;
+  for(i = 0; i < scratch->matches->len; ++i)
+  {
+    match = &g_array_index(scratch->matches, InfinotedPluginReplacerMatch, i);
+    g_string_append_len(
+      scratch->next,
+      scratch->text->str + index,
+      match->index - index
+    );
+    g_string_append_len(scratch->next, val, val_slen);
+    index = match->index + key_slen;
+  }
+
+  g_string_erase(scratch->text, first->index, end - first->index);
+  g_string_insert_len(
+    scratch->text,
+    first->index,
+    scratch->next->str,
+    scratch->next->len
+  );
+
+  infinoted_plugin_replacer_scratch_shift(
+    scratch,
+    offset + first->offset,
+    last->offset + key_ulen - first->offset,
+    end - first->index,
+    last->offset + key_ulen - first->offset +
+      scratch->matches->len * (val_ulen - key_ulen),
+    scratch->next->len
+  );
+}
+
+/* Marks the rules whose key starts between the byte indices begin and end
+ * of the scratch text as candidates for the current run */
+static void
+infinoted_plugin_replacer_scratch_mark(InfinotedPluginReplacerScratch* scratch,
+                                       const InfinotedPluginReplacerTable* table,
+                                       gsize begin,
+                                       gsize end)
+{
+  infinoted_plugin_replacer_table_mark_keys(
+    table,
+    scratch->text->str,
+    scratch->text->len,
+    begin,
+    MIN(end, scratch->text->len),
+    (guint32*)scratch->candidates->data
+  );
+}
+
+/* To be called when chunk has been inserted at pos into the buffer of the
+ * session, except by infinoted_plugin_replacer_core_run(). */
+void
+infinoted_plugin_replacer_scratch_text_inserted(
+  InfinotedPluginReplacerScratch* scratch,
+  guint pos,
+  InfTextChunk* chunk)
+{
+  guint len;
+
+  len = inf_text_chunk_get_length(chunk);
+  if(scratch->synced)
+    infinoted_plugin_replacer_scratch_insert(scratch, pos, chunk);
+
+  if(scratch->dirty_end >= pos)
+    scratch->dirty_end += len;
+  scratch->dirty_begin = MIN(scratch->dirty_begin, pos);
+  scratch->dirty_end = MAX(scratch->dirty_end, pos + len);
+}
+
+/* To be called when chunk has been erased at pos from the buffer of the
+ * session, except by infinoted_plugin_replacer_core_run(). */
+void
+infinoted_plugin_replacer_scratch_text_erased(
+  InfinotedPluginReplacerScratch* scratch,
+  guint pos,
+  InfTextChunk* chunk)
+{
+  guint len;
+
+  len = inf_text_chunk_get_length(chunk);
+  if(scratch->synced)
+    infinoted_plugin_replacer_scratch_erase(scratch, pos, chunk);
+
+  if(scratch->dirty_end >= pos + len)
+    scratch->dirty_end -= len;
+  else if(scratch->dirty_end > pos)
+    scratch->dirty_end = pos;
+  scratch->dirty_begin = MIN(scratch->dirty_begin, pos);
+  scratch->dirty_end = MAX(scratch->dirty_end, pos);
+}
+
+/* Whether buf starts with the magic string which turns the replacer on.
+ * When scratch is synced its text is read instead of the buffer, so that
+ * the check allocates nothing. */
+gboolean
+infinoted_plugin_replacer_core_check_enabled(
+  const InfinotedPluginReplacerScratch* scratch,
+  InfTextBuffer* buf)
+{
+  /* Magic string to use at the beginning of the file */
+  static const gchar magic_string[] = "#replacer on\n";
+  gchar start[sizeof(magic_string) - 1];
+  gsize magic_len;
+  gsize start_len;
+  gsize bytes;
+  InfTextChunk* chunk;
+  InfTextChunkIter iter;
+
+  /* The magic string is ASCII, so that its length in characters is its
+   * length in bytes */
+  magic_len = sizeof(magic_string) - 1;
+  if(inf_text_buffer_get_length(buf) <= magic_len)
+    return FALSE;
+
+  if(scratch->synced)
+    return memcmp(scratch->text->str, magic_string, magic_len) == 0;
+
+  chunk = inf_text_buffer_get_slice(buf, 0, magic_len);
+  start_len = 0;
+  if(inf_text_chunk_iter_init_begin(chunk, &iter))
+  {
+    do
+    {
+      bytes = MIN(inf_text_chunk_iter_get_bytes(&iter), magic_len - start_len);
+      memcpy(start + start_len, inf_text_chunk_iter_get_text(&iter), bytes);
+      start_len += bytes;
+    } while(start_len < magic_len && inf_text_chunk_iter_next(&iter));
+  }
+  inf_text_chunk_free(chunk);
+
+  return start_len == magic_len &&
+    memcmp(start, magic_string, magic_len) == 0;
+}
+
+/* The original algorithm: every rule is applied to the whole buffer, which
+ * is read again for every rule. It is kept as a reference for
+ * infinoted_plugin_replacer_core_run(). Returns the number of operations
+ * done on buf. */
+guint
+infinoted_plugin_replacer_core_run_reference(
+  const InfinotedPluginReplacerTable* table,
+  InfTextBuffer* buf,
+  InfUser* user)
+{
+	guint operations = 0;
+	guint i;
+	guint n_rules = infinoted_plugin_replacer_table_get_n_rules(table);
+	for (i = 0; i < n_rules; i++) {
+		const InfinotedPluginReplacerRule* rule =
+			infinoted_plugin_replacer_table_get_rule(table, i);
+		const gchar* key = infinoted_plugin_replacer_table_get_key(table, rule);
+		const gchar* val = infinoted_plugin_replacer_table_get_value(table, rule);
+		if (val == NULL)
+			continue;
+		gint diff = 0;
+		//foreach word the buffer must be re-read to allow nested macros
+		InfTextChunk* chunk = inf_text_buffer_get_slice(buf,
+		                                                0,
+		                                                inf_text_buffer_get_length(buf));
+		gsize out_len;
+		gchar* chunk_str = inf_text_chunk_get_text(chunk, &out_len);
+		//the chunk text is not nul-terminated
+		gchar* buf_str = g_strndup(chunk_str, out_len);
+		gchar* tmp_buf_str = buf_str;
+		guint key_slen = strlen(key);
+		guint key_ulen = g_utf8_strlen(key, -1);
+		guint val_slen = strlen(val);
+		guint val_ulen = g_utf8_strlen(val, -1);
+		while (NULL != (tmp_buf_str = g_strstr_len(tmp_buf_str, -1, key))) {
+			glong offset = g_utf8_pointer_to_offset (buf_str, tmp_buf_str);
+			offset += diff;
+			diff += val_ulen - key_ulen;
+			inf_text_buffer_insert_text(buf, offset, val, val_slen, val_ulen, user);
+			inf_text_buffer_erase_text(buf, offset + val_ulen, key_ulen, user);
+			operations += 2;
+			tmp_buf_str += key_slen;
+		}
+		inf_text_chunk_free(chunk);
+		g_free(chunk_str);
+		g_free(buf_str);
+	}
+	return operations;
+}
+
+
+/* Replaces the keys of table in buf, on behalf of user. The scratch
+ * buffers of the session are kept in sync with buf if incremental is TRUE
+ * and the table allows it, see infinoted_plugin_replacer_scratch_text_inserted().
+ * Returns the number of operations done on buf. */
+guint
+infinoted_plugin_replacer_core_run(InfinotedPluginReplacerScratch* scratch,
+                                   const InfinotedPluginReplacerTable* table,
+                                   gboolean incremental,
+                                   InfTextBuffer* buf,
+                                   InfUser* user)
+{
+	glong margin = infinoted_plugin_replacer_table_get_max_key_ulen(table);
+	glong length = inf_text_buffer_get_length(buf);
+	//part of the document to scan, in characters
+	glong begin;
+	glong end;
+	guint operations = 0;
+
+	//incremental can be turned off between runs, see verify in the plugin
+	if (scratch->synced == FALSE || incremental == FALSE) {
+		//the buffer is read as a whole: the passes work on the scratch copy,
+		//which is kept in sync with the replacements done in the buffer
+		InfTextChunk* chunk = inf_text_buffer_get_slice(buf, 0, length);
+		infinoted_plugin_replacer_scratch_load(scratch, chunk);
+		inf_text_chunk_free(chunk);
+		//with a stable table, the copy also follows the edits made until the
+		//next run, which then only needs to scan around them
+		scratch->synced = incremental &&
+			infinoted_plugin_replacer_table_get_stable(table);
+		begin = 0;
+		end = length;
+	} else if (scratch->dirty_begin > scratch->dirty_end) {
+		begin = 0;
+		end = 0;
+	} else {
+		begin = MAX((glong)scratch->dirty_begin - margin, 0);
+		end = MIN((glong)scratch->dirty_end + margin, length);
+	}
+	scratch->dirty_begin = G_MAXUINT;
+	scratch->dirty_end = 0;
+
+	gsize begin_index = infinoted_plugin_replacer_scratch_index(scratch, begin);
+	gsize end_index = end == length ? scratch->text->len :
+		infinoted_plugin_replacer_scratch_index(scratch, end);
+
+	guint n_rules = infinoted_plugin_replacer_table_get_n_rules(table);
+	gsize max_key_slen = infinoted_plugin_replacer_table_get_max_key_slen(table);
+	//with many rules, looking up the keys found at each position of the text
+	//is cheaper than scanning the text for each key
+	gboolean use_candidates = n_rules > max_key_slen && begin < end;
+	guint32* candidates = NULL;
+	if (use_candidates) {
+		g_array_set_size(scratch->candidates, (n_rules + 31) / 32);
+		candidates = (guint32*)scratch->candidates->data;
+		memset(candidates, 0, scratch->candidates->len * sizeof(guint32));
+		infinoted_plugin_replacer_scratch_mark(scratch, table,
+		                                       begin_index, end_index);
+	}
+
+  //foreach replace_words
+  guint i = 0;
+	for (i = 0; i < n_rules && begin < end; i++) {
+		if (use_candidates && (candidates[i / 32] & (1u << (i % 32))) == 0)
+			continue;
+		//foreach word the text is scanned again to allow nested macros
+		const InfinotedPluginReplacerRule* rule =
+			infinoted_plugin_replacer_table_get_rule(table, i);
+		const gchar* key = infinoted_plugin_replacer_table_get_key(table, rule);
+		const gchar* val = infinoted_plugin_replacer_table_get_value(table, rule);
+		if (val == NULL)
+			continue;
+
+		gsize key_slen = rule->key_slen;
+		glong key_ulen = rule->key_ulen;
+		infinoted_plugin_replacer_scratch_scan(scratch, begin_index, end_index,
+		                                       key, key_slen, key_ulen);
+		if (scratch->matches->len == 0)
+			continue;
+
+		gsize val_slen = rule->val_slen;
+		glong val_ulen = rule->val_ulen;
+		glong diff = 0;
+		guint j;
+		for (j = 0; j < scratch->matches->len; j++) {
+			InfinotedPluginReplacerMatch* match = &g_array_index(
+				scratch->matches, InfinotedPluginReplacerMatch, j);
+			glong offset = begin + match->offset + diff;
+			diff += val_ulen - key_ulen;
+			//replace
+			inf_text_buffer_insert_text(buf, offset,val,val_slen, val_ulen, user);
+			inf_text_buffer_erase_text(buf, offset + val_ulen, key_ulen, user);
+			operations += 2;
+		}
+
+		glong first = begin + g_array_index(scratch->matches,
+			InfinotedPluginReplacerMatch, 0).offset;
+		glong last = begin + g_array_index(scratch->matches,
+			InfinotedPluginReplacerMatch, scratch->matches->len - 1).offset
+			+ diff - (val_ulen - key_ulen) + val_ulen;
+		gsize first_index = g_array_index(scratch->matches,
+			InfinotedPluginReplacerMatch, 0).index;
+		infinoted_plugin_replacer_scratch_apply(scratch, begin, key_slen, key_ulen,
+		                                        val, val_slen, val_ulen);
+		length += diff;
+		//keys of later rules can start in the rebuilt text, or end in it
+		if (use_candidates)
+			infinoted_plugin_replacer_scratch_mark(scratch, table,
+				first_index > max_key_slen - 1 ? first_index - (max_key_slen - 1) : 0,
+				first_index + scratch->next->len);
+		//the replacements can form new keys with the text around them
+		begin = MAX(MIN(begin, first - margin), 0);
+		end = MIN(MAX(end + diff, last + margin), length);
+		begin_index = infinoted_plugin_replacer_scratch_index(scratch, begin);
+		end_index = end == length ? scratch->text->len :
+			infinoted_plugin_replacer_scratch_index(scratch, end);
+	}
+	return operations;
+}
+
+/* vim:set et sw=2 ts=2: */
@@ -0,0 +1,123 @@
+/*
+ * infinoted-plugin-replacer - a real-time replacer for text sessions
+ * on an infinoted server.
+ * Copyright (C) 2016 Pietro Brenna <pietrobrenna@zoho.com>
+ * Copyright (C) 2016 Alessandro Bregoli <>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+*/
+
+#ifndef __INFINOTED_PLUGIN_REPLACER_CORE_H__
+#define __INFINOTED_PLUGIN_REPLACER_CORE_H__
+
+#include "infinoted-plugin-replacer-table.h"
+
+#include <libinftext/inf-text-buffer.h>
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Size the scratch buffers start with */
+#define INFINOTED_PLUGIN_REPLACER_SCRATCH_SIZE 4096
+/* Latency histogram buckets: four per power of two microseconds */
+#define INFINOTED_PLUGIN_REPLACER_LATENCY_BUCKETS 160
+
+/* Time from the first edit after a run to the end of the next run */
+typedef struct _InfinotedPluginReplacerLatency InfinotedPluginReplacerLatency;
+struct _InfinotedPluginReplacerLatency {
+  guint64 counts[INFINOTED_PLUGIN_REPLACER_LATENCY_BUCKETS];
+  guint64 total;
+  gint64 max;
+};
+
+/* Buffers reused by every run of a session, so that a run in steady state
+ * does not need to allocate anything. */
+typedef struct _InfinotedPluginReplacerScratch InfinotedPluginReplacerScratch;
+struct _InfinotedPluginReplacerScratch {
+  GString* text; /* document text as seen by the current pass */
+  GString* next; /* replaced part of the text being built by a pass */
+  GArray* matches; /* InfinotedPluginReplacerMatch */
+  GArray* checkpoints; /* InfinotedPluginReplacerCheckpoint, sorted */
+  GArray* candidates; /* guint32 bitmap of the rules that can match */
+  gsize stride;
+  /* Whether text follows the buffer between runs */
+  gboolean synced;
+  /* Largest infinoted_plugin_replacer_scratch_get_size() after a run */
+  gsize high_water;
+  /* Largest lengths the arrays have had */
+  guint matches_peak;
+  guint checkpoints_peak;
+  gsize initial_size; /* bytes held right after initialization */
+  /* Characters edited since the last run, empty if dirty_begin > dirty_end */
+  guint dirty_begin;
+  guint dirty_end;
+};
+
+void
+infinoted_plugin_replacer_latency_add(InfinotedPluginReplacerLatency* latency,
+                                      gint64 usec);
+
+guint64
+infinoted_plugin_replacer_latency_percentile(
+  const InfinotedPluginReplacerLatency* latency,
+  guint percentile);
+
+void
+infinoted_plugin_replacer_scratch_init(InfinotedPluginReplacerScratch* scratch);
+
+void
+infinoted_plugin_replacer_scratch_release(
+  InfinotedPluginReplacerScratch* scratch);
+
+gsize
+infinoted_plugin_replacer_scratch_get_size(
+  const InfinotedPluginReplacerScratch* scratch);
+
+void
+infinoted_plugin_replacer_scratch_text_inserted(
+  InfinotedPluginReplacerScratch* scratch,
+  guint pos,
+  InfTextChunk* chunk);
+
+void
+infinoted_plugin_replacer_scratch_text_erased(
+  InfinotedPluginReplacerScratch* scratch,
+  guint pos,
+  InfTextChunk* chunk);
+
+gboolean
+infinoted_plugin_replacer_core_check_enabled(
+  const InfinotedPluginReplacerScratch* scratch,
+  InfTextBuffer* buf);
+
+guint
+infinoted_plugin_replacer_core_run(InfinotedPluginReplacerScratch* scratch,
+                                   const InfinotedPluginReplacerTable* table,
+                                   gboolean incremental,
+                                   InfTextBuffer* buf,
+                                   InfUser* user);
+
+guint
+infinoted_plugin_replacer_core_run_reference(
+  const InfinotedPluginReplacerTable* table,
+  InfTextBuffer* buf,
+  InfUser* user);
+
+G_END_DECLS
+
+#endif /* __INFINOTED_PLUGIN_REPLACER_CORE_H__ */
+
+/* vim:set et sw=2 ts=2: */
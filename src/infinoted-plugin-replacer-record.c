@@ -0,0 +1,524 @@
+/*
+ * infinoted-plugin-replacer - a real-time replacer for text sessions
+ * on an infinoted server.
+ * Copyright (C) 2016 Pietro Brenna <pietrobrenna@zoho.com>
+ * Copyright (C) 2016 Alessandro Bregoli <>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+*/
+
+/* Recordings of the edits the replacer sees in a session, which
+ * infinoted-replacer-replay can feed through the replacer again.
+ *
+ * A recording starts with the magic bytes "IRRL", followed by the format
+ * version. Each event is then written as its type in a single byte, the
+ * microseconds since the previous event and the fields of its type:
+ *
+ *   snapshot: length, bytes, text
+ *   insert:   position, user, length, bytes, text
+ *   erase:    position, user, length
+ *   run:      nothing
+ *
+ * Numbers are unsigned LEB128, so that most of them take a single byte. */
+
+#include "infinoted-plugin-replacer-record.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#define INFINOTED_PLUGIN_REPLACER_RECORD_MAGIC "IRRL"
+#define INFINOTED_PLUGIN_REPLACER_RECORD_VERSION 1
+/* Largest amount of microseconds between flushes while edits keep coming.
+ * Every run flushes, so that nothing is left unwritten once a session is
+ * idle. */
+#define INFINOTED_PLUGIN_REPLACER_RECORD_FLUSH_INTERVAL G_USEC_PER_SEC
+
+struct _InfinotedPluginReplacerRecorder {
+  FILE* file;
+  gchar* filename;
+  GString* record; /* event being encoded */
+  gint64 start;
+  gint64 last;
+  gint64 last_flush;
+};
+
+struct _InfinotedPluginReplacerRecordReader {
+  GMappedFile* file;
+  const guchar* pos;
+  const guchar* end;
+  gint64 time;
+};
+
+GQuark
+infinoted_plugin_replacer_record_error_quark(void)
+{
+  return g_quark_from_static_string("INFINOTED_PLUGIN_REPLACER_RECORD_ERROR");
+}
+
+static void
+infinoted_plugin_replacer_record_append_number(GString* record,
+                                               guint64 value)
+{
+  while(value >= 0x80)
+  {
+    g_string_append_c(record, (gchar)((value & 0x7f) | 0x80));
+    value >>= 7;
+  }
+
+  g_string_append_c(record, (gchar)value);
+}
+
+static void
+infinoted_plugin_replacer_record_append_chunk(GString* record,
+                                              InfTextChunk* chunk)
+{
+  InfTextChunkIter iter;
+  gsize bytes;
+
+  bytes = 0;
+  if(inf_text_chunk_iter_init_begin(chunk, &iter))
+  {
+    do
+    {
+      bytes += inf_text_chunk_iter_get_bytes(&iter);
+    } while(inf_text_chunk_iter_next(&iter));
+  }
+
+  infinoted_plugin_replacer_record_append_number(
+    record,
+    inf_text_chunk_get_length(chunk)
+  );
+
+  infinoted_plugin_replacer_record_append_number(record, bytes);
+
+  if(inf_text_chunk_iter_init_begin(chunk, &iter))
+  {
+    do
+    {
+      g_string_append_len(
+        record,
+        inf_text_chunk_iter_get_text(&iter),
+        inf_text_chunk_iter_get_bytes(&iter)
+      );
+    } while(inf_text_chunk_iter_next(&iter));
+  }
+}
+
+/* Starts a new event of the given type in the record buffer */
+static void
+infinoted_plugin_replacer_recorder_begin(
+  InfinotedPluginReplacerRecorder* recorder,
+  InfinotedPluginReplacerRecordType type)
+{
+  gint64 now;
+
+  now = g_get_monotonic_time();
+
+  g_string_truncate(recorder->record, 0);
+  g_string_append_c(recorder->record, (gchar)type);
+  infinoted_plugin_replacer_record_append_number(
+    recorder->record,
+    now - recorder->last
+  );
+
+  recorder->last = now;
+}
+
+static void
+infinoted_plugin_replacer_recorder_end(
+  InfinotedPluginReplacerRecorder* recorder,
+  gboolean flush)
+{
+  /* Errors are reported by infinoted_plugin_replacer_recorder_free() */
+  fwrite(recorder->record->str, 1, recorder->record->len, recorder->file);
+
+  if(flush ||
+     recorder->last - recorder->last_flush >=
+       INFINOTED_PLUGIN_REPLACER_RECORD_FLUSH_INTERVAL)
+  {
+    fflush(recorder->file);
+    recorder->last_flush = recorder->last;
+  }
+}
+
+/* Creates a recording in filename, replacing any existing file */
+InfinotedPluginReplacerRecorder*
+infinoted_plugin_replacer_recorder_new(const gchar* filename,
+                                       GError** error)
+{
+  InfinotedPluginReplacerRecorder* recorder;
+  FILE* file;
+
+  file = fopen(filename, "wb");
+  if(file == NULL)
+  {
+    g_set_error(
+      error,
+      G_FILE_ERROR,
+      g_file_error_from_errno(errno),
+      "Could not create recording \"%s\": %s",
+      filename,
+      g_strerror(errno)
+    );
+
+    return NULL;
+  }
+
+  recorder = g_slice_new(InfinotedPluginReplacerRecorder);
+  recorder->file = file;
+  recorder->filename = g_strdup(filename);
+  recorder->record = g_string_new(INFINOTED_PLUGIN_REPLACER_RECORD_MAGIC);
+  recorder->start = g_get_monotonic_time();
+  recorder->last = recorder->start;
+  recorder->last_flush = recorder->start;
+
+  infinoted_plugin_replacer_record_append_number(
+    recorder->record,
+    INFINOTED_PLUGIN_REPLACER_RECORD_VERSION
+  );
+
+  infinoted_plugin_replacer_recorder_end(recorder, FALSE);
+  return recorder;
+}
+
+/* Closes the recording. Returns FALSE if any of its events could not be
+ * written. */
+gboolean
+infinoted_plugin_replacer_recorder_free(
+  InfinotedPluginReplacerRecorder* recorder,
+  GError** error)
+{
+  gboolean result;
+
+  result = TRUE;
+  if(ferror(recorder->file) || fclose(recorder->file) != 0)
+  {
+    g_set_error(
+      error,
+      G_FILE_ERROR,
+      G_FILE_ERROR_IO,
+      "Could not write recording \"%s\"",
+      recorder->filename
+    );
+
+    result = FALSE;
+  }
+
+  g_string_free(recorder->record, TRUE);
+  g_free(recorder->filename);
+  g_slice_free(InfinotedPluginReplacerRecorder, recorder);
+  return result;
+}
+
+void
+infinoted_plugin_replacer_recorder_snapshot(
+  InfinotedPluginReplacerRecorder* recorder,
+  InfTextBuffer* buffer)
+{
+  InfTextChunk* chunk;
+
+  chunk = inf_text_buffer_get_slice(
+    buffer,
+    0,
+    inf_text_buffer_get_length(buffer)
+  );
+
+  infinoted_plugin_replacer_recorder_begin(
+    recorder,
+    INFINOTED_PLUGIN_REPLACER_RECORD_SNAPSHOT
+  );
+
+  infinoted_plugin_replacer_record_append_chunk(recorder->record, chunk);
+  infinoted_plugin_replacer_recorder_end(recorder, FALSE);
+  inf_text_chunk_free(chunk);
+}
+
+void
+infinoted_plugin_replacer_recorder_insert(
+  InfinotedPluginReplacerRecorder* recorder,
+  guint pos,
+  InfTextChunk* chunk,
+  InfUser* user)
+{
+  infinoted_plugin_replacer_recorder_begin(
+    recorder,
+    INFINOTED_PLUGIN_REPLACER_RECORD_INSERT
+  );
+
+  infinoted_plugin_replacer_record_append_number(recorder->record, pos);
+  infinoted_plugin_replacer_record_append_number(
+    recorder->record,
+    user != NULL ? inf_user_get_id(user) : 0
+  );
+
+  infinoted_plugin_replacer_record_append_chunk(recorder->record, chunk);
+  infinoted_plugin_replacer_recorder_end(recorder, FALSE);
+}
+
+void
+infinoted_plugin_replacer_recorder_erase(
+  InfinotedPluginReplacerRecorder* recorder,
+  guint pos,
+  InfTextChunk* chunk,
+  InfUser* user)
+{
+  infinoted_plugin_replacer_recorder_begin(
+    recorder,
+    INFINOTED_PLUGIN_REPLACER_RECORD_ERASE
+  );
+
+  infinoted_plugin_replacer_record_append_number(recorder->record, pos);
+  infinoted_plugin_replacer_record_append_number(
+    recorder->record,
+    user != NULL ? inf_user_get_id(user) : 0
+  );
+
+  infinoted_plugin_replacer_record_append_number(
+    recorder->record,
+    inf_text_chunk_get_length(chunk)
+  );
+
+  infinoted_plugin_replacer_recorder_end(recorder, FALSE);
+}
+
+void
+infinoted_plugin_replacer_recorder_run(
+  InfinotedPluginReplacerRecorder* recorder)
+{
+  infinoted_plugin_replacer_recorder_begin(
+    recorder,
+    INFINOTED_PLUGIN_REPLACER_RECORD_RUN
+  );
+
+  /* A run follows the edits of the session, and may be the last event for
+   * a long time */
+  infinoted_plugin_replacer_recorder_end(recorder, TRUE);
+}
+
+static gboolean
+infinoted_plugin_replacer_record_reader_number(
+  InfinotedPluginReplacerRecordReader* reader,
+  guint64* value)
+{
+  guint shift;
+
+  *value = 0;
+  for(shift = 0; shift < 64 && reader->pos < reader->end; shift += 7)
+  {
+    *value |= (guint64)(*reader->pos & 0x7f) << shift;
+    if((*reader->pos++ & 0x80) == 0)
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+/* Reads a number which has to fit a guint */
+static gboolean
+infinoted_plugin_replacer_record_reader_uint(
+  InfinotedPluginReplacerRecordReader* reader,
+  guint* value)
+{
+  guint64 number;
+
+  if(!infinoted_plugin_replacer_record_reader_number(reader, &number) ||
+     number > G_MAXUINT)
+  {
+    return FALSE;
+  }
+
+  *value = number;
+  return TRUE;
+}
+
+/* Reads the length and text of a snapshot or an insertion, checking that
+ * the text is valid UTF-8 of the given length, as the buffer relies on it */
+static gboolean
+infinoted_plugin_replacer_record_reader_text(
+  InfinotedPluginReplacerRecordReader* reader,
+  InfinotedPluginReplacerRecordEvent* event)
+{
+  guint64 bytes;
+
+  if(!infinoted_plugin_replacer_record_reader_uint(reader, &event->len) ||
+     !infinoted_plugin_replacer_record_reader_number(reader, &bytes))
+  {
+    return FALSE;
+  }
+
+  /* Text cut off by the end of the file is where the recording ends */
+  if(bytes > (guint64)(reader->end - reader->pos))
+  {
+    reader->pos = reader->end;
+    return FALSE;
+  }
+
+  event->text = (const gchar*)reader->pos;
+  event->bytes = bytes;
+  reader->pos += bytes;
+
+  return g_utf8_validate(event->text, event->bytes, NULL) &&
+    g_utf8_strlen(event->text, event->bytes) == event->len;
+}
+
+InfinotedPluginReplacerRecordReader*
+infinoted_plugin_replacer_record_reader_new(const gchar* filename,
+                                            GError** error)
+{
+  InfinotedPluginReplacerRecordReader* reader;
+  GMappedFile* file;
+  guint64 version;
+  gsize magic_len;
+
+  file = g_mapped_file_new(filename, FALSE, error);
+  if(file == NULL)
+    return NULL;
+
+  reader = g_slice_new(InfinotedPluginReplacerRecordReader);
+  reader->file = file;
+  reader->pos = (const guchar*)g_mapped_file_get_contents(file);
+  reader->end = reader->pos + g_mapped_file_get_length(file);
+  reader->time = 0;
+
+  magic_len = strlen(INFINOTED_PLUGIN_REPLACER_RECORD_MAGIC);
+  if((gsize)(reader->end - reader->pos) < magic_len ||
+     memcmp(reader->pos, INFINOTED_PLUGIN_REPLACER_RECORD_MAGIC,
+            magic_len) != 0)
+  {
+    g_set_error(
+      error,
+      INFINOTED_PLUGIN_REPLACER_RECORD_ERROR,
+      INFINOTED_PLUGIN_REPLACER_RECORD_ERROR_NOT_A_RECORDING,
+      "\"%s\" is not a replacer recording",
+      filename
+    );
+
+    infinoted_plugin_replacer_record_reader_free(reader);
+    return NULL;
+  }
+
+  reader->pos += magic_len;
+  if(!infinoted_plugin_replacer_record_reader_number(reader, &version) ||
+     version != INFINOTED_PLUGIN_REPLACER_RECORD_VERSION)
+  {
+    g_set_error(
+      error,
+      INFINOTED_PLUGIN_REPLACER_RECORD_ERROR,
+      INFINOTED_PLUGIN_REPLACER_RECORD_ERROR_VERSION,
+      "Recording \"%s\" has an unsupported format version",
+      filename
+    );
+
+    infinoted_plugin_replacer_record_reader_free(reader);
+    return NULL;
+  }
+
+  return reader;
+}
+
+void
+infinoted_plugin_replacer_record_reader_free(
+  InfinotedPluginReplacerRecordReader* reader)
+{
+  g_mapped_file_unref(reader->file);
+  g_slice_free(InfinotedPluginReplacerRecordReader, reader);
+}
+
+/* Reads the next event of the recording. The text of the event stays
+ * valid until the reader is freed. Returns FALSE at the end of the
+ * recording, and if the event is corrupt, in which case error is set. A
+ * recording whose last event was cut short, for example because the
+ * server was killed, just ends before that event. */
+gboolean
+infinoted_plugin_replacer_record_reader_next(
+  InfinotedPluginReplacerRecordReader* reader,
+  InfinotedPluginReplacerRecordEvent* event,
+  GError** error)
+{
+  const guchar* start;
+  guint64 delta;
+  gboolean valid;
+
+  if(reader->pos == reader->end)
+    return FALSE;
+
+  start = reader->pos;
+  event->type = *reader->pos++;
+  event->pos = 0;
+  event->len = 0;
+  event->user = 0;
+  event->text = NULL;
+  event->bytes = 0;
+
+  valid = infinoted_plugin_replacer_record_reader_number(reader, &delta);
+  switch(event->type)
+  {
+  case INFINOTED_PLUGIN_REPLACER_RECORD_SNAPSHOT:
+    valid = valid &&
+      infinoted_plugin_replacer_record_reader_text(reader, event);
+    break;
+  case INFINOTED_PLUGIN_REPLACER_RECORD_INSERT:
+    valid = valid &&
+      infinoted_plugin_replacer_record_reader_uint(reader, &event->pos) &&
+      infinoted_plugin_replacer_record_reader_uint(reader, &event->user) &&
+      infinoted_plugin_replacer_record_reader_text(reader, event);
+    break;
+  case INFINOTED_PLUGIN_REPLACER_RECORD_ERASE:
+    valid = valid &&
+      infinoted_plugin_replacer_record_reader_uint(reader, &event->pos) &&
+      infinoted_plugin_replacer_record_reader_uint(reader, &event->user) &&
+      infinoted_plugin_replacer_record_reader_uint(reader, &event->len);
+    break;
+  case INFINOTED_PLUGIN_REPLACER_RECORD_RUN:
+    break;
+  default:
+    g_set_error(
+      error,
+      INFINOTED_PLUGIN_REPLACER_RECORD_ERROR,
+      INFINOTED_PLUGIN_REPLACER_RECORD_ERROR_CORRUPT,
+      "Unknown event type %u at byte %" G_GSIZE_FORMAT " of the recording",
+      (guint)event->type,
+      (gsize)(start - (const guchar*)g_mapped_file_get_contents(reader->file))
+    );
+
+    return FALSE;
+  }
+
+  if(!valid)
+  {
+    /* Only the last event can be incomplete */
+    if(reader->pos < reader->end)
+    {
+      g_set_error(
+        error,
+        INFINOTED_PLUGIN_REPLACER_RECORD_ERROR,
+        INFINOTED_PLUGIN_REPLACER_RECORD_ERROR_CORRUPT,
+        "Invalid event at byte %" G_GSIZE_FORMAT " of the recording",
+        (gsize)(start - (const guchar*)g_mapped_file_get_contents(reader->file))
+      );
+    }
+
+    reader->pos = reader->end;
+    return FALSE;
+  }
+
+  reader->time += delta;
+  event->time = reader->time;
+  return TRUE;
+}
+
+/* vim:set et sw=2 ts=2: */
@@ -0,0 +1,122 @@
+/*
+ * infinoted-plugin-replacer - a real-time replacer for text sessions
+ * on an infinoted server.
+ * Copyright (C) 2016 Pietro Brenna <pietrobrenna@zoho.com>
+ * Copyright (C) 2016 Alessandro Bregoli <>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+*/
+
+#ifndef __INFINOTED_PLUGIN_REPLACER_RECORD_H__
+#define __INFINOTED_PLUGIN_REPLACER_RECORD_H__
+
+#include <libinftext/inf-text-buffer.h>
+#include <libinfinity/common/inf-user.h>
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define INFINOTED_PLUGIN_REPLACER_RECORD_ERROR \
+  (infinoted_plugin_replacer_record_error_quark())
+
+typedef enum _InfinotedPluginReplacerRecordError {
+  INFINOTED_PLUGIN_REPLACER_RECORD_ERROR_NOT_A_RECORDING,
+  INFINOTED_PLUGIN_REPLACER_RECORD_ERROR_VERSION,
+  INFINOTED_PLUGIN_REPLACER_RECORD_ERROR_CORRUPT
+} InfinotedPluginReplacerRecordError;
+
+typedef enum _InfinotedPluginReplacerRecordType {
+  /* the whole document, when the replacer starts to follow it */
+  INFINOTED_PLUGIN_REPLACER_RECORD_SNAPSHOT,
+  INFINOTED_PLUGIN_REPLACER_RECORD_INSERT,
+  INFINOTED_PLUGIN_REPLACER_RECORD_ERASE,
+  /* a replacer run, whose own edits are not recorded */
+  INFINOTED_PLUGIN_REPLACER_RECORD_RUN
+} InfinotedPluginReplacerRecordType;
+
+/* An event read from a recording. Positions and lengths are in characters,
+ * text is only set for snapshots and insertions, and is not nul-terminated.
+ * The text of erasures is not recorded. */
+typedef struct _InfinotedPluginReplacerRecordEvent
+  InfinotedPluginReplacerRecordEvent;
+struct _InfinotedPluginReplacerRecordEvent {
+  InfinotedPluginReplacerRecordType type;
+  gint64 time; /* microseconds since the start of the recording */
+  guint pos;
+  guint len;
+  guint user; /* user ID, 0 if there was no user */
+  const gchar* text;
+  gsize bytes;
+};
+
+typedef struct _InfinotedPluginReplacerRecorder InfinotedPluginReplacerRecorder;
+typedef struct _InfinotedPluginReplacerRecordReader
+  InfinotedPluginReplacerRecordReader;
+
+GQuark
+infinoted_plugin_replacer_record_error_quark(void);
+
+InfinotedPluginReplacerRecorder*
+infinoted_plugin_replacer_recorder_new(const gchar* filename,
+                                       GError** error);
+
+gboolean
+infinoted_plugin_replacer_recorder_free(
+  InfinotedPluginReplacerRecorder* recorder,
+  GError** error);
+
+void
+infinoted_plugin_replacer_recorder_snapshot(
+  InfinotedPluginReplacerRecorder* recorder,
+  InfTextBuffer* buffer);
+
+void
+infinoted_plugin_replacer_recorder_insert(
+  InfinotedPluginReplacerRecorder* recorder,
+  guint pos,
+  InfTextChunk* chunk,
+  InfUser* user);
+
+void
+infinoted_plugin_replacer_recorder_erase(
+  InfinotedPluginReplacerRecorder* recorder,
+  guint pos,
+  InfTextChunk* chunk,
+  InfUser* user);
+
+void
+infinoted_plugin_replacer_recorder_run(
+  InfinotedPluginReplacerRecorder* recorder);
+
+InfinotedPluginReplacerRecordReader*
+infinoted_plugin_replacer_record_reader_new(const gchar* filename,
+                                            GError** error);
+
+void
+infinoted_plugin_replacer_record_reader_free(
+  InfinotedPluginReplacerRecordReader* reader);
+
+gboolean
+infinoted_plugin_replacer_record_reader_next(
+  InfinotedPluginReplacerRecordReader* reader,
+  InfinotedPluginReplacerRecordEvent* event,
+  GError** error);
+
+G_END_DECLS
+
+#endif /* __INFINOTED_PLUGIN_REPLACER_RECORD_H__ */
+
+/* vim:set et sw=2 ts=2: */
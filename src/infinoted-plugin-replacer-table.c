@@ -0,0 +1,1182 @@
+/*
+ * infinoted-plugin-replacer - a real-time replacer for text sessions
+ * on an infinoted server.
+ * Copyright (C) 2016 Pietro Brenna <pietrobrenna@zoho.com>
+ * Copyright (C) 2016 Alessandro Bregoli <>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+*/
+
+/* A replace table compiled into a single block of memory. The block only
+ * contains offsets, no pointers, so that it can be placed in a POSIX
+ * shared memory segment and used by every infinoted instance on the host
+ * which loads the same table. The segment is named after a hash of the
+ * JSON file, so that instances with different tables do not meet.
+ *
+ * The block consists of a header, the rules in the order they are applied
+ * in, a hash index of the keys, a flag for every key length telling
+ * whether there is a key of that length, and the strings. Equal values are
+ * stored only once. The index is made of buckets the size of a cache line,
+ * each holding up to eight keys; a full bucket overflows into the next
+ * one. */
+
+#include "infinoted-plugin-replacer-table.h"
+
+#include <json-glib/json-glib.h>
+
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#define INFINOTED_PLUGIN_REPLACER_TABLE_MAGIC 0x42545249 /* "IRTB" */
+#define INFINOTED_PLUGIN_REPLACER_TABLE_VERSION 2
+/* Largest table for which incremental rescans are considered */
+#define INFINOTED_PLUGIN_REPLACER_TABLE_STABLE_CHECK_MAX 2048
+
+#define INFINOTED_PLUGIN_REPLACER_TABLE_STABLE (1 << 0)
+
+#define INFINOTED_PLUGIN_REPLACER_TABLE_BUCKET_SIZE 8
+#define INFINOTED_PLUGIN_REPLACER_TABLE_EMPTY G_MAXUINT32
+#define INFINOTED_PLUGIN_REPLACER_TABLE_ALIGN 64
+
+typedef struct _InfinotedPluginReplacerTableSlot
+  InfinotedPluginReplacerTableSlot;
+struct _InfinotedPluginReplacerTableSlot {
+  guint32 hash;
+  guint32 rule;
+};
+
+typedef struct _InfinotedPluginReplacerTableBucket
+  InfinotedPluginReplacerTableBucket;
+struct _InfinotedPluginReplacerTableBucket {
+  InfinotedPluginReplacerTableSlot
+    slots[INFINOTED_PLUGIN_REPLACER_TABLE_BUCKET_SIZE];
+};
+
+typedef struct _InfinotedPluginReplacerTableHeader
+  InfinotedPluginReplacerTableHeader;
+struct _InfinotedPluginReplacerTableHeader {
+  guint32 magic;
+  guint32 version;
+  guint32 size;
+  guint32 n_rules;
+  guint32 n_ignored;
+  guint32 max_key_ulen;
+  guint32 max_key_slen;
+  guint32 flags;
+  /* Offsets from the start of the table */
+  guint32 buckets;
+  guint32 n_buckets; /* a power of two */
+  guint32 lengths; /* max_key_slen + 1 flags */
+  guint32 strings;
+  /* Set last by the process publishing the table */
+  gint ready;
+};
+
+struct _InfinotedPluginReplacerTable {
+  const InfinotedPluginReplacerTableHeader* header;
+  const InfinotedPluginReplacerRule* rules;
+  const InfinotedPluginReplacerTableBucket* buckets;
+  const guint8* lengths;
+  const gchar* strings;
+  gchar* data; /* the table if it is not mapped, aligned in alloc */
+  gpointer alloc;
+  gpointer map;
+  gsize map_size;
+  InfinotedPluginReplacerTableSource source;
+  gchar* share_error; /* why a table to be shared is private */
+};
+
+GQuark
+infinoted_plugin_replacer_table_error_quark(void)
+{
+  return g_quark_from_static_string("INFINOTED_PLUGIN_REPLACER_TABLE_ERROR");
+}
+
+static void
+infinoted_plugin_replacer_table_set_data(InfinotedPluginReplacerTable* table,
+                                         const gchar* data)
+{
+  table->header = (const InfinotedPluginReplacerTableHeader*)data;
+  table->rules = (const InfinotedPluginReplacerRule*)
+    (data + sizeof(InfinotedPluginReplacerTableHeader));
+  table->buckets = (const InfinotedPluginReplacerTableBucket*)
+    (data + table->header->buckets);
+  table->lengths = (const guint8*)(data + table->header->lengths);
+  table->strings = data + table->header->strings;
+}
+
+/* FNV-1a, which can be computed one byte at a time while looking for keys
+ * of increasing length */
+#define INFINOTED_PLUGIN_REPLACER_TABLE_HASH_INIT 2166136261u
+#define INFINOTED_PLUGIN_REPLACER_TABLE_HASH_STEP(hash, c) \
+  (((hash) ^ (guint8)(c)) * 16777619u)
+
+static guint32
+infinoted_plugin_replacer_table_hash(const gchar* str,
+                                     gsize len)
+{
+  guint32 hash;
+  gsize i;
+
+  hash = INFINOTED_PLUGIN_REPLACER_TABLE_HASH_INIT;
+  for(i = 0; i < len; ++i)
+    hash = INFINOTED_PLUGIN_REPLACER_TABLE_HASH_STEP(hash, str[i]);
+
+  return hash;
+}
+
+static guint32
+infinoted_plugin_replacer_table_find(const InfinotedPluginReplacerTable* table,
+                                     guint32 hash,
+                                     const gchar* key,
+                                     gsize key_slen)
+{
+  const InfinotedPluginReplacerTableBucket* bucket;
+  const InfinotedPluginReplacerRule* rule;
+  guint32 index;
+  guint i;
+
+  index = hash & (table->header->n_buckets - 1);
+  for(;;)
+  {
+    bucket = &table->buckets[index];
+    for(i = 0; i < INFINOTED_PLUGIN_REPLACER_TABLE_BUCKET_SIZE; ++i)
+    {
+      if(bucket->slots[i].rule == INFINOTED_PLUGIN_REPLACER_TABLE_EMPTY)
+        return INFINOTED_PLUGIN_REPLACER_TABLE_EMPTY;
+
+      if(bucket->slots[i].hash == hash)
+      {
+        rule = &table->rules[bucket->slots[i].rule];
+        if(rule->key_slen == key_slen &&
+           memcmp(table->strings + rule->key, key, key_slen) == 0)
+        {
+          return bucket->slots[i].rule;
+        }
+      }
+    }
+
+    index = (index + 1) & (table->header->n_buckets - 1);
+  }
+}
+
+/* Whether an occurrence of key can overlap with a replacement by val */
+static gboolean
+infinoted_plugin_replacer_table_overlaps(const gchar* key,
+                                         gsize key_slen,
+                                         const gchar* val,
+                                         gsize val_slen)
+{
+  gsize k;
+
+  /* Removing a key joins the text around it */
+  if(val_slen == 0)
+    return TRUE;
+
+  if(strstr(val, key) != NULL || strstr(key, val) != NULL)
+    return TRUE;
+
+  for(k = 1; k < MIN(key_slen, val_slen); ++k)
+  {
+    if(memcmp(val + val_slen - k, key, k) == 0)
+      return TRUE;
+    if(memcmp(key + key_slen - k, val, k) == 0)
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+/* A table is stable if no replacement can produce an occurrence of its own
+ * key or of a key applied before it. After a run with a stable table no key
+ * is left in the document, so the next run only needs to look at the text
+ * around the edits made in the meanwhile. */
+static gboolean
+infinoted_plugin_replacer_table_check_stable(
+  const InfinotedPluginReplacerRule* rules,
+  guint n_rules,
+  const gchar* strings)
+{
+  guint i;
+  guint j;
+
+  if(n_rules > INFINOTED_PLUGIN_REPLACER_TABLE_STABLE_CHECK_MAX)
+    return FALSE;
+
+  for(i = 0; i < n_rules; ++i)
+  {
+    if(rules[i].val == INFINOTED_PLUGIN_REPLACER_TABLE_NO_VALUE)
+      continue;
+
+    for(j = 0; j <= i; ++j)
+    {
+      if(rules[j].val == INFINOTED_PLUGIN_REPLACER_TABLE_NO_VALUE)
+        continue;
+
+      if(infinoted_plugin_replacer_table_overlaps(strings + rules[j].key,
+                                                  rules[j].key_slen,
+                                                  strings + rules[i].val,
+                                                  rules[i].val_slen))
+      {
+        return FALSE;
+      }
+    }
+  }
+
+  return TRUE;
+}
+
+static gint
+infinoted_plugin_replacer_table_compare_keys(gconstpointer a,
+                                             gconstpointer b,
+                                             gpointer user_data)
+{
+  const InfinotedPluginReplacerRule* rule_a;
+  const InfinotedPluginReplacerRule* rule_b;
+  const gchar* strings;
+
+  rule_a = (const InfinotedPluginReplacerRule*)a;
+  rule_b = (const InfinotedPluginReplacerRule*)b;
+  strings = (const gchar*)user_data;
+
+  return strcmp(strings + rule_a->key, strings + rule_b->key);
+}
+
+/* A key is not allowed to be a prefix of another key. If a key is a prefix
+ * of other keys, these follow it directly in sorted order. */
+static gboolean
+infinoted_plugin_replacer_table_check_prefixes(
+  const InfinotedPluginReplacerRule* rules,
+  guint n_rules,
+  const gchar* strings,
+  GError** error)
+{
+  InfinotedPluginReplacerRule* sorted;
+  const gchar* key;
+  const gchar* next;
+  guint i;
+
+#if GLIB_CHECK_VERSION(2, 68, 0)
+  sorted = g_memdup2(rules, n_rules * sizeof(InfinotedPluginReplacerRule));
+#else
+  sorted = g_memdup(rules, n_rules * sizeof(InfinotedPluginReplacerRule));
+#endif
+  g_qsort_with_data(
+    sorted,
+    n_rules,
+    sizeof(InfinotedPluginReplacerRule),
+    infinoted_plugin_replacer_table_compare_keys,
+    (gpointer)strings
+  );
+
+  /* An empty key sorts first, and would match everywhere */
+  if(n_rules > 0 && sorted[0].key_slen == 0)
+  {
+    g_set_error(
+      error,
+      INFINOTED_PLUGIN_REPLACER_TABLE_ERROR,
+      INFINOTED_PLUGIN_REPLACER_TABLE_ERROR_PREFIX,
+      "Error: empty keys are not allowed."
+    );
+
+    g_free(sorted);
+    return FALSE;
+  }
+
+  for(i = 0; i + 1 < n_rules; ++i)
+  {
+    key = strings + sorted[i].key;
+    next = strings + sorted[i + 1].key;
+    if(strncmp(next, key, sorted[i].key_slen) == 0)
+    {
+      g_set_error(
+        error,
+        INFINOTED_PLUGIN_REPLACER_TABLE_ERROR,
+        INFINOTED_PLUGIN_REPLACER_TABLE_ERROR_PREFIX,
+        "Error: '%s' is a prefix of '%s', which is not allowed: a simple "
+        "solution is to append a space.",
+        key,
+        next
+      );
+
+      g_free(sorted);
+      return FALSE;
+    }
+  }
+
+  g_free(sorted);
+  return TRUE;
+}
+
+static guint32
+infinoted_plugin_replacer_table_add_string(GString* strings,
+                                           const gchar* str,
+                                           guint32* slen,
+                                           guint32* ulen)
+{
+  guint32 offset;
+
+  offset = strings->len;
+  *slen = strlen(str);
+  *ulen = g_utf8_strlen(str, *slen);
+  g_string_append_len(strings, str, *slen + 1);
+
+  return offset;
+}
+
+static void
+infinoted_plugin_replacer_table_add_value(GString* strings,
+                                          GHashTable* values,
+                                          const gchar* val,
+                                          InfinotedPluginReplacerRule* rule)
+{
+  gpointer offset;
+
+  /* Values are often repeated, keep only one copy of each */
+  if(g_hash_table_lookup_extended(values, val, NULL, &offset))
+  {
+    rule->val = GPOINTER_TO_UINT(offset);
+    rule->val_slen = strlen(val);
+    rule->val_ulen = g_utf8_strlen(val, rule->val_slen);
+  }
+  else
+  {
+    rule->val = infinoted_plugin_replacer_table_add_string(
+      strings,
+      val,
+      &rule->val_slen,
+      &rule->val_ulen
+    );
+
+    g_hash_table_insert(
+      values,
+      g_strdup(val),
+      GUINT_TO_POINTER(rule->val)
+    );
+  }
+}
+
+static void
+infinoted_plugin_replacer_table_build_index(
+  InfinotedPluginReplacerTableBucket* buckets,
+  guint32 n_buckets,
+  const InfinotedPluginReplacerRule* rules,
+  guint n_rules,
+  const gchar* strings)
+{
+  InfinotedPluginReplacerTableSlot* slot;
+  guint32 hash;
+  guint32 index;
+  guint i;
+  guint j;
+
+  for(index = 0; index < n_buckets; ++index)
+  {
+    for(j = 0; j < INFINOTED_PLUGIN_REPLACER_TABLE_BUCKET_SIZE; ++j)
+    {
+      buckets[index].slots[j].hash = 0;
+      buckets[index].slots[j].rule = INFINOTED_PLUGIN_REPLACER_TABLE_EMPTY;
+    }
+  }
+
+  for(i = 0; i < n_rules; ++i)
+  {
+    /* Rules without value are never looked up */
+    if(rules[i].val == INFINOTED_PLUGIN_REPLACER_TABLE_NO_VALUE)
+      continue;
+
+    hash = infinoted_plugin_replacer_table_hash(
+      strings + rules[i].key,
+      rules[i].key_slen
+    );
+
+    slot = NULL;
+    index = hash & (n_buckets - 1);
+    while(slot == NULL)
+    {
+      for(j = 0; j < INFINOTED_PLUGIN_REPLACER_TABLE_BUCKET_SIZE; ++j)
+      {
+        if(buckets[index].slots[j].rule == INFINOTED_PLUGIN_REPLACER_TABLE_EMPTY)
+        {
+          slot = &buckets[index].slots[j];
+          break;
+        }
+      }
+
+      index = (index + 1) & (n_buckets - 1);
+    }
+
+    slot->hash = hash;
+    slot->rule = i;
+  }
+}
+
+/* Compiles the JSON table in contents into data, aligned in alloc. Rules
+ * keep the order of the members in the JSON object, which is the order
+ * they are applied in. */
+static gboolean
+infinoted_plugin_replacer_table_compile(const gchar* contents,
+                                        gsize length,
+                                        gpointer* alloc,
+                                        gchar** data,
+                                        gsize* size,
+                                        GError** error)
+{
+  InfinotedPluginReplacerTableHeader header;
+  InfinotedPluginReplacerRule* rules;
+  JsonParser* parser;
+  JsonReader* reader;
+  GString* strings;
+  GHashTable* values;
+  gchar** members;
+  const gchar* val;
+  guint8* lengths;
+  gsize buckets;
+  guint n_rules;
+  guint i;
+
+  parser = json_parser_new();
+  if(!json_parser_load_from_data(parser, contents, length, error))
+  {
+    g_object_unref(parser);
+    return FALSE;
+  }
+
+  reader = json_reader_new(json_parser_get_root(parser));
+  members = json_reader_list_members(reader);
+  if(members == NULL)
+  {
+    g_set_error(
+      error,
+      INFINOTED_PLUGIN_REPLACER_TABLE_ERROR,
+      INFINOTED_PLUGIN_REPLACER_TABLE_ERROR_NOT_AN_OBJECT,
+      "Error: the replace table is not a JSON object"
+    );
+
+    g_object_unref(reader);
+    g_object_unref(parser);
+    return FALSE;
+  }
+
+  n_rules = json_reader_count_members(reader);
+  rules = g_new(InfinotedPluginReplacerRule, n_rules);
+  strings = g_string_new(NULL);
+  values = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+  header.magic = INFINOTED_PLUGIN_REPLACER_TABLE_MAGIC;
+  header.version = INFINOTED_PLUGIN_REPLACER_TABLE_VERSION;
+  header.n_rules = n_rules;
+  header.n_ignored = 0;
+  header.max_key_ulen = 0;
+  header.max_key_slen = 0;
+  header.flags = 0;
+  header.ready = 0;
+
+  for(i = 0; i < n_rules; ++i)
+  {
+    rules[i].key = infinoted_plugin_replacer_table_add_string(
+      strings,
+      members[i],
+      &rules[i].key_slen,
+      &rules[i].key_ulen
+    );
+
+    header.max_key_ulen = MAX(header.max_key_ulen, rules[i].key_ulen);
+    header.max_key_slen = MAX(header.max_key_slen, rules[i].key_slen);
+
+    json_reader_read_member(reader, members[i]);
+    val = json_reader_get_string_value(reader);
+    if(json_reader_get_error(reader) != NULL)
+    {
+      /* Rules without a string value are ignored by the runs */
+      rules[i].val = INFINOTED_PLUGIN_REPLACER_TABLE_NO_VALUE;
+      rules[i].val_slen = 0;
+      rules[i].val_ulen = 0;
+      ++header.n_ignored;
+      json_reader_set_root(reader, json_parser_get_root(parser));
+    }
+    else
+    {
+      infinoted_plugin_replacer_table_add_value(
+        strings,
+        values,
+        val,
+        &rules[i]
+      );
+
+      json_reader_end_member(reader);
+    }
+  }
+
+  g_hash_table_destroy(values);
+  g_strfreev(members);
+  g_object_unref(reader);
+  g_object_unref(parser);
+
+  /* Eight slots per bucket, filled to at most three quarters */
+  header.n_buckets = 1;
+  while(header.n_buckets * 6 < n_rules)
+    header.n_buckets *= 2;
+
+  buckets = sizeof(header) + (gsize)n_rules * sizeof(InfinotedPluginReplacerRule);
+  buckets = (buckets + INFINOTED_PLUGIN_REPLACER_TABLE_ALIGN - 1) &
+    ~(gsize)(INFINOTED_PLUGIN_REPLACER_TABLE_ALIGN - 1);
+  *size = buckets +
+    (gsize)header.n_buckets * sizeof(InfinotedPluginReplacerTableBucket) +
+    header.max_key_slen + 1 + strings->len;
+
+  if(*size > G_MAXUINT32)
+  {
+    g_set_error(
+      error,
+      INFINOTED_PLUGIN_REPLACER_TABLE_ERROR,
+      INFINOTED_PLUGIN_REPLACER_TABLE_ERROR_TOO_LARGE,
+      "Error: the replace table is too large"
+    );
+
+    g_string_free(strings, TRUE);
+    g_free(rules);
+    return FALSE;
+  }
+
+  if(!infinoted_plugin_replacer_table_check_prefixes(rules, n_rules,
+                                                     strings->str, error))
+  {
+    g_string_free(strings, TRUE);
+    g_free(rules);
+    return FALSE;
+  }
+
+  if(infinoted_plugin_replacer_table_check_stable(rules, n_rules,
+                                                  strings->str))
+  {
+    header.flags |= INFINOTED_PLUGIN_REPLACER_TABLE_STABLE;
+  }
+
+  header.buckets = buckets;
+  header.lengths = header.buckets +
+    header.n_buckets * sizeof(InfinotedPluginReplacerTableBucket);
+  header.strings = header.lengths + header.max_key_slen + 1;
+  header.size = *size;
+
+  /* Buckets should not straddle cache lines */
+  *alloc = g_malloc0(*size + INFINOTED_PLUGIN_REPLACER_TABLE_ALIGN);
+  *data = (gchar*)(((guintptr)*alloc + INFINOTED_PLUGIN_REPLACER_TABLE_ALIGN - 1) &
+    ~(guintptr)(INFINOTED_PLUGIN_REPLACER_TABLE_ALIGN - 1));
+
+  memcpy(*data, &header, sizeof(header));
+  memcpy(
+    *data + sizeof(header),
+    rules,
+    n_rules * sizeof(InfinotedPluginReplacerRule)
+  );
+
+  infinoted_plugin_replacer_table_build_index(
+    (InfinotedPluginReplacerTableBucket*)(*data + header.buckets),
+    header.n_buckets,
+    rules,
+    n_rules,
+    strings->str
+  );
+
+  lengths = (guint8*)(*data + header.lengths);
+  for(i = 0; i < n_rules; ++i)
+    if(rules[i].val != INFINOTED_PLUGIN_REPLACER_TABLE_NO_VALUE)
+      lengths[rules[i].key_slen] = 1;
+
+  memcpy(*data + header.strings, strings->str, strings->len);
+
+  g_string_free(strings, TRUE);
+  g_free(rules);
+  return TRUE;
+}
+
+static gboolean
+infinoted_plugin_replacer_table_check_string(const gchar* strings,
+                                             gsize strings_size,
+                                             guint32 offset,
+                                             guint32 slen)
+{
+  return offset < strings_size &&
+         slen < strings_size - offset &&
+         strings[offset + slen] == '\0';
+}
+
+/* Checks that a table mapped from shared memory is complete and that none
+ * of its offsets points outside of it. */
+static gboolean
+infinoted_plugin_replacer_table_validate(const gchar* data,
+                                         gsize size)
+{
+  const InfinotedPluginReplacerTableHeader* header;
+  const InfinotedPluginReplacerRule* rules;
+  const InfinotedPluginReplacerTableBucket* buckets;
+  const gchar* strings;
+  gsize strings_size;
+  gboolean has_empty;
+  guint32 rule;
+  guint i;
+  guint j;
+
+  if(size < sizeof(InfinotedPluginReplacerTableHeader))
+    return FALSE;
+
+  header = (const InfinotedPluginReplacerTableHeader*)data;
+  if(header->magic != INFINOTED_PLUGIN_REPLACER_TABLE_MAGIC ||
+     header->version != INFINOTED_PLUGIN_REPLACER_TABLE_VERSION ||
+     header->size != size ||
+     g_atomic_int_get(&header->ready) != 1)
+  {
+    return FALSE;
+  }
+
+  if(header->n_buckets == 0 ||
+     (header->n_buckets & (header->n_buckets - 1)) != 0 ||
+     sizeof(*header) +
+       (gsize)header->n_rules * sizeof(InfinotedPluginReplacerRule) >
+       header->buckets ||
+     header->buckets +
+       (gsize)header->n_buckets * sizeof(InfinotedPluginReplacerTableBucket) >
+       header->lengths ||
+     header->lengths + (gsize)header->max_key_slen + 1 > header->strings ||
+     header->strings > size)
+  {
+    return FALSE;
+  }
+
+  rules = (const InfinotedPluginReplacerRule*)(data + sizeof(*header));
+  buckets = (const InfinotedPluginReplacerTableBucket*)(data + header->buckets);
+  strings = data + header->strings;
+  strings_size = size - header->strings;
+
+  for(i = 0; i < header->n_rules; ++i)
+  {
+    if(rules[i].key_slen > header->max_key_slen ||
+       !infinoted_plugin_replacer_table_check_string(strings, strings_size,
+                                                     rules[i].key,
+                                                     rules[i].key_slen))
+    {
+      return FALSE;
+    }
+
+    if(rules[i].val != INFINOTED_PLUGIN_REPLACER_TABLE_NO_VALUE &&
+       !infinoted_plugin_replacer_table_check_string(strings, strings_size,
+                                                     rules[i].val,
+                                                     rules[i].val_slen))
+    {
+      return FALSE;
+    }
+  }
+
+  /* Lookups stop at the first empty slot, so there needs to be one */
+  has_empty = FALSE;
+  for(i = 0; i < header->n_buckets; ++i)
+  {
+    for(j = 0; j < INFINOTED_PLUGIN_REPLACER_TABLE_BUCKET_SIZE; ++j)
+    {
+      rule = buckets[i].slots[j].rule;
+      if(rule == INFINOTED_PLUGIN_REPLACER_TABLE_EMPTY)
+        has_empty = TRUE;
+      else if(rule >= header->n_rules)
+        return FALSE;
+    }
+  }
+
+  return has_empty;
+}
+
+/* Replaces the reason why the table is not shared */
+static void
+infinoted_plugin_replacer_table_set_share_error(
+  InfinotedPluginReplacerTable* table,
+  gchar* share_error)
+{
+  g_free(table->share_error);
+  table->share_error = share_error;
+}
+
+/* Opens and locks the lock file of the segment name. The lock is held
+ * while the segment is looked at, and while the table is compiled and
+ * published into it, so that no process sees a segment being created or
+ * filled. The lock file is kept, as removing it would let two processes
+ * lock different files of the same name. Returns the locked file
+ * descriptor, or -1. */
+static int
+infinoted_plugin_replacer_table_lock(InfinotedPluginReplacerTable* table,
+                                     const gchar* name)
+{
+  gchar* filename;
+  int saved_errno;
+  int result;
+  int fd;
+
+  filename = g_strdup_printf("%s%s.lock", g_get_user_runtime_dir(), name);
+
+  fd = open(filename, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if(fd != -1)
+  {
+    do
+    {
+      result = flock(fd, LOCK_EX);
+    } while(result == -1 && errno == EINTR);
+
+    if(result == -1)
+    {
+      saved_errno = errno;
+      close(fd);
+      fd = -1;
+      errno = saved_errno;
+    }
+  }
+
+  if(fd == -1)
+  {
+    infinoted_plugin_replacer_table_set_share_error(
+      table,
+      g_strdup_printf("Cannot lock %s: %s", filename, g_strerror(errno))
+    );
+  }
+
+  g_free(filename);
+  return fd;
+}
+
+/* Maps the segment name if another process has published the table there.
+ * The lock of infinoted_plugin_replacer_table_lock() must be held, so a
+ * segment which is not ready has been left behind by a process which died
+ * while publishing it. Such a segment is removed, for this process to
+ * publish the table anew. */
+static gboolean
+infinoted_plugin_replacer_table_attach(InfinotedPluginReplacerTable* table,
+                                       const gchar* name)
+{
+  const InfinotedPluginReplacerTableHeader* header;
+  struct stat st;
+  gpointer map;
+  gboolean ready;
+  int fd;
+
+  fd = shm_open(name, O_RDONLY, 0);
+  if(fd == -1)
+  {
+    if(errno != ENOENT)
+    {
+      infinoted_plugin_replacer_table_set_share_error(
+        table,
+        g_strdup_printf("Cannot open %s: %s", name, g_strerror(errno))
+      );
+    }
+
+    return FALSE;
+  }
+
+  /* Only trust segments created by our own user */
+  if(fstat(fd, &st) == -1 || st.st_uid != geteuid())
+  {
+    infinoted_plugin_replacer_table_set_share_error(
+      table,
+      g_strdup_printf("%s belongs to another user", name)
+    );
+
+    close(fd);
+    return FALSE;
+  }
+
+  map = MAP_FAILED;
+  ready = FALSE;
+  if(st.st_size >= (off_t)sizeof(InfinotedPluginReplacerTableHeader))
+  {
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if(map == MAP_FAILED)
+    {
+      infinoted_plugin_replacer_table_set_share_error(
+        table,
+        g_strdup_printf("Cannot map %s: %s", name, g_strerror(errno))
+      );
+
+      close(fd);
+      return FALSE;
+    }
+
+    header = (const InfinotedPluginReplacerTableHeader*)map;
+    ready = g_atomic_int_get(&header->ready) == 1;
+  }
+
+  if(!ready)
+  {
+    shm_unlink(name);
+
+    if(map != MAP_FAILED)
+      munmap(map, st.st_size);
+    close(fd);
+    return FALSE;
+  }
+
+  close(fd);
+
+  if(!infinoted_plugin_replacer_table_validate(map, st.st_size))
+  {
+    infinoted_plugin_replacer_table_set_share_error(
+      table,
+      g_strdup_printf("%s does not hold a valid replace table", name)
+    );
+
+    munmap(map, st.st_size);
+    return FALSE;
+  }
+
+  table->map = map;
+  table->map_size = st.st_size;
+  table->source = INFINOTED_PLUGIN_REPLACER_TABLE_ATTACHED;
+  infinoted_plugin_replacer_table_set_data(table, map);
+  return TRUE;
+}
+
+/* Moves the privately compiled table into a new shared memory segment,
+ * with the lock of infinoted_plugin_replacer_table_lock() held. If the
+ * segment exists already, for example because it belongs to another user,
+ * the private copy is kept. */
+static void
+infinoted_plugin_replacer_table_publish(InfinotedPluginReplacerTable* table,
+                                        const gchar* name,
+                                        gsize size)
+{
+  InfinotedPluginReplacerTableHeader* header;
+  gpointer map;
+  int fd;
+
+  fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if(fd == -1)
+  {
+    /* Keep the reason found by infinoted_plugin_replacer_table_attach() */
+    if(errno != EEXIST || table->share_error == NULL)
+    {
+      infinoted_plugin_replacer_table_set_share_error(
+        table,
+        g_strdup_printf("Cannot create %s: %s", name, g_strerror(errno))
+      );
+    }
+
+    return;
+  }
+
+  if(ftruncate(fd, size) == -1)
+  {
+    infinoted_plugin_replacer_table_set_share_error(
+      table,
+      g_strdup_printf("Cannot create %s: %s", name, g_strerror(errno))
+    );
+
+    close(fd);
+    shm_unlink(name);
+    return;
+  }
+
+  map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if(map == MAP_FAILED)
+  {
+    infinoted_plugin_replacer_table_set_share_error(
+      table,
+      g_strdup_printf("Cannot map %s: %s", name, g_strerror(errno))
+    );
+
+    close(fd);
+    shm_unlink(name);
+    return;
+  }
+
+  memcpy(map, table->data, size);
+  header = (InfinotedPluginReplacerTableHeader*)map;
+  g_atomic_int_set(&header->ready, 1);
+  mprotect(map, size, PROT_READ);
+  close(fd);
+
+  g_free(table->alloc);
+  table->alloc = NULL;
+  table->data = NULL;
+  table->map = map;
+  table->map_size = size;
+  table->source = INFINOTED_PLUGIN_REPLACER_TABLE_PUBLISHED;
+  infinoted_plugin_replacer_table_set_share_error(table, NULL);
+  infinoted_plugin_replacer_table_set_data(table, map);
+}
+
+/* Loads the JSON replace table in filename. If shared is TRUE, the compiled
+ * table is taken from shared memory if another process has placed it there
+ * already, and placed there otherwise. A process compiling the same table
+ * is waited for. Segments are not removed when the process exits, so that
+ * later instances can still attach to them. */
+InfinotedPluginReplacerTable*
+infinoted_plugin_replacer_table_load(const gchar* filename,
+                                     gboolean shared,
+                                     GError** error)
+{
+  InfinotedPluginReplacerTable* table;
+  gchar* contents;
+  gsize length;
+  gchar* hash;
+  gchar* name;
+  gsize size;
+  int lock;
+
+  if(!g_file_get_contents(filename, &contents, &length, error))
+    return NULL;
+
+  table = g_slice_new(InfinotedPluginReplacerTable);
+  table->data = NULL;
+  table->alloc = NULL;
+  table->map = NULL;
+  table->map_size = 0;
+  table->source = INFINOTED_PLUGIN_REPLACER_TABLE_PRIVATE;
+  table->share_error = NULL;
+
+  name = NULL;
+  lock = -1;
+  if(shared)
+  {
+    hash = g_compute_checksum_for_data(
+      G_CHECKSUM_SHA256,
+      (const guchar*)contents,
+      length
+    );
+
+    name = g_strdup_printf(
+      "/infinoted-replacer-%u-%s",
+      INFINOTED_PLUGIN_REPLACER_TABLE_VERSION,
+      hash
+    );
+
+    g_free(hash);
+
+    lock = infinoted_plugin_replacer_table_lock(table, name);
+    if(lock == -1)
+    {
+      g_free(name);
+      name = NULL;
+    }
+    else if(infinoted_plugin_replacer_table_attach(table, name))
+    {
+      close(lock);
+      g_free(name);
+      g_free(contents);
+      return table;
+    }
+  }
+
+  if(!infinoted_plugin_replacer_table_compile(contents, length,
+                                              &table->alloc, &table->data,
+                                              &size, error))
+  {
+    if(lock != -1)
+      close(lock);
+
+    g_free(contents);
+    g_free(name);
+    g_free(table->share_error);
+    g_slice_free(InfinotedPluginReplacerTable, table);
+    return NULL;
+  }
+
+  g_free(contents);
+
+  infinoted_plugin_replacer_table_set_data(table, table->data);
+
+  if(name != NULL)
+  {
+    infinoted_plugin_replacer_table_publish(table, name, size);
+    close(lock);
+    g_free(name);
+  }
+
+  return table;
+}
+
+void
+infinoted_plugin_replacer_table_free(InfinotedPluginReplacerTable* table)
+{
+  if(table->map != NULL)
+    munmap(table->map, table->map_size);
+
+  g_free(table->alloc);
+  g_free(table->share_error);
+  g_slice_free(InfinotedPluginReplacerTable, table);
+}
+
+InfinotedPluginReplacerTableSource
+infinoted_plugin_replacer_table_get_source(
+  const InfinotedPluginReplacerTable* table)
+{
+  return table->source;
+}
+
+/* Returns why a table loaded with shared set is private, or NULL */
+const gchar*
+infinoted_plugin_replacer_table_get_share_error(
+  const InfinotedPluginReplacerTable* table)
+{
+  return table->share_error;
+}
+
+guint
+infinoted_plugin_replacer_table_get_n_rules(
+  const InfinotedPluginReplacerTable* table)
+{
+  return table->header->n_rules;
+}
+
+guint
+infinoted_plugin_replacer_table_get_n_ignored(
+  const InfinotedPluginReplacerTable* table)
+{
+  return table->header->n_ignored;
+}
+
+gsize
+infinoted_plugin_replacer_table_get_size(
+  const InfinotedPluginReplacerTable* table)
+{
+  return table->header->size;
+}
+
+guint
+infinoted_plugin_replacer_table_get_max_key_slen(
+  const InfinotedPluginReplacerTable* table)
+{
+  return table->header->max_key_slen;
+}
+
+guint
+infinoted_plugin_replacer_table_get_max_key_ulen(
+  const InfinotedPluginReplacerTable* table)
+{
+  return table->header->max_key_ulen;
+}
+
+gboolean
+infinoted_plugin_replacer_table_get_stable(
+  const InfinotedPluginReplacerTable* table)
+{
+  return (table->header->flags & INFINOTED_PLUGIN_REPLACER_TABLE_STABLE) != 0;
+}
+
+const InfinotedPluginReplacerRule*
+infinoted_plugin_replacer_table_get_rule(
+  const InfinotedPluginReplacerTable* table,
+  guint index)
+{
+  return &table->rules[index];
+}
+
+const gchar*
+infinoted_plugin_replacer_table_get_key(
+  const InfinotedPluginReplacerTable* table,
+  const InfinotedPluginReplacerRule* rule)
+{
+  return table->strings + rule->key;
+}
+
+/* Returns NULL for rules whose value is not a string */
+const gchar*
+infinoted_plugin_replacer_table_get_value(
+  const InfinotedPluginReplacerTable* table,
+  const InfinotedPluginReplacerRule* rule)
+{
+  if(rule->val == INFINOTED_PLUGIN_REPLACER_TABLE_NO_VALUE)
+    return NULL;
+
+  return table->strings + rule->val;
+}
+
+/* Returns the rule with the given key, or NULL if there is none. Rules
+ * whose value is not a string are not found. */
+const InfinotedPluginReplacerRule*
+infinoted_plugin_replacer_table_lookup(
+  const InfinotedPluginReplacerTable* table,
+  const gchar* key,
+  gsize key_slen)
+{
+  guint32 rule;
+
+  if(key_slen > table->header->max_key_slen ||
+     !table->lengths[key_slen])
+  {
+    return NULL;
+  }
+
+  rule = infinoted_plugin_replacer_table_find(
+    table,
+    infinoted_plugin_replacer_table_hash(key, key_slen),
+    key,
+    key_slen
+  );
+
+  if(rule == INFINOTED_PLUGIN_REPLACER_TABLE_EMPTY)
+    return NULL;
+
+  return &table->rules[rule];
+}
+
+/* Sets the bit of every rule whose key starts between the byte indices
+ * begin and end of text, which is len bytes long, in marks. */
+void
+infinoted_plugin_replacer_table_mark_keys(
+  const InfinotedPluginReplacerTable* table,
+  const gchar* text,
+  gsize len,
+  gsize begin,
+  gsize end,
+  guint32* marks)
+{
+  guint32 hash;
+  guint32 rule;
+  gsize max_slen;
+  gsize pos;
+  gsize slen;
+
+  for(pos = begin; pos < end; ++pos)
+  {
+    /* The hash of every prefix comes for free while hashing a longer one */
+    max_slen = MIN(table->header->max_key_slen, len - pos);
+    hash = INFINOTED_PLUGIN_REPLACER_TABLE_HASH_INIT;
+    for(slen = 1; slen <= max_slen; ++slen)
+    {
+      hash = INFINOTED_PLUGIN_REPLACER_TABLE_HASH_STEP(hash, text[pos + slen - 1]);
+      if(!table->lengths[slen])
+        continue;
+
+      rule = infinoted_plugin_replacer_table_find(
+        table,
+        hash,
+        text + pos,
+        slen
+      );
+
+      /* Keys are not prefixes of each other, so there is no longer one */
+      if(rule != INFINOTED_PLUGIN_REPLACER_TABLE_EMPTY)
+      {
+        marks[rule / 32] |= 1u << (rule % 32);
+        break;
+      }
+    }
+  }
+}
+
+/* vim:set et sw=2 ts=2: */
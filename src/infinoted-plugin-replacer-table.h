@@ -0,0 +1,145 @@
+/*
+ * infinoted-plugin-replacer - a real-time replacer for text sessions
+ * on an infinoted server.
+ * Copyright (C) 2016 Pietro Brenna <pietrobrenna@zoho.com>
+ * Copyright (C) 2016 Alessandro Bregoli <>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+*/
+
+#ifndef __INFINOTED_PLUGIN_REPLACER_TABLE_H__
+#define __INFINOTED_PLUGIN_REPLACER_TABLE_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define INFINOTED_PLUGIN_REPLACER_TABLE_ERROR \
+  (infinoted_plugin_replacer_table_error_quark())
+
+typedef enum _InfinotedPluginReplacerTableError {
+  INFINOTED_PLUGIN_REPLACER_TABLE_ERROR_NOT_AN_OBJECT,
+  INFINOTED_PLUGIN_REPLACER_TABLE_ERROR_PREFIX,
+  INFINOTED_PLUGIN_REPLACER_TABLE_ERROR_TOO_LARGE
+} InfinotedPluginReplacerTableError;
+
+/* Where the compiled table of infinoted_plugin_replacer_table_load() comes
+ * from */
+typedef enum _InfinotedPluginReplacerTableSource {
+  /* compiled by this process, not shared */
+  INFINOTED_PLUGIN_REPLACER_TABLE_PRIVATE,
+  /* compiled by this process and placed in shared memory */
+  INFINOTED_PLUGIN_REPLACER_TABLE_PUBLISHED,
+  /* compiled by another process, attached from shared memory */
+  INFINOTED_PLUGIN_REPLACER_TABLE_ATTACHED
+} InfinotedPluginReplacerTableSource;
+
+/* Value offset of rules whose value is not a string. These rules are
+ * ignored. */
+#define INFINOTED_PLUGIN_REPLACER_TABLE_NO_VALUE G_MAXUINT32
+
+/* A rule of a compiled table. Offsets are relative to the string area of
+ * the table, lengths are in bytes (slen) and in characters (ulen). */
+typedef struct _InfinotedPluginReplacerRule InfinotedPluginReplacerRule;
+struct _InfinotedPluginReplacerRule {
+  guint32 key;
+  guint32 key_slen;
+  guint32 key_ulen;
+  guint32 val;
+  guint32 val_slen;
+  guint32 val_ulen;
+};
+
+typedef struct _InfinotedPluginReplacerTable InfinotedPluginReplacerTable;
+
+GQuark
+infinoted_plugin_replacer_table_error_quark(void);
+
+InfinotedPluginReplacerTable*
+infinoted_plugin_replacer_table_load(const gchar* filename,
+                                     gboolean shared,
+                                     GError** error);
+
+void
+infinoted_plugin_replacer_table_free(InfinotedPluginReplacerTable* table);
+
+InfinotedPluginReplacerTableSource
+infinoted_plugin_replacer_table_get_source(
+  const InfinotedPluginReplacerTable* table);
+
+const gchar*
+infinoted_plugin_replacer_table_get_share_error(
+  const InfinotedPluginReplacerTable* table);
+
+guint
+infinoted_plugin_replacer_table_get_n_rules(
+  const InfinotedPluginReplacerTable* table);
+
+guint
+infinoted_plugin_replacer_table_get_n_ignored(
+  const InfinotedPluginReplacerTable* table);
+
+gsize
+infinoted_plugin_replacer_table_get_size(
+  const InfinotedPluginReplacerTable* table);
+
+guint
+infinoted_plugin_replacer_table_get_max_key_slen(
+  const InfinotedPluginReplacerTable* table);
+
+guint
+infinoted_plugin_replacer_table_get_max_key_ulen(
+  const InfinotedPluginReplacerTable* table);
+
+gboolean
+infinoted_plugin_replacer_table_get_stable(
+  const InfinotedPluginReplacerTable* table);
+
+const InfinotedPluginReplacerRule*
+infinoted_plugin_replacer_table_get_rule(
+  const InfinotedPluginReplacerTable* table,
+  guint index);
+
+const gchar*
+infinoted_plugin_replacer_table_get_key(
+  const InfinotedPluginReplacerTable* table,
+  const InfinotedPluginReplacerRule* rule);
+
+const gchar*
+infinoted_plugin_replacer_table_get_value(
+  const InfinotedPluginReplacerTable* table,
+  const InfinotedPluginReplacerRule* rule);
+
+const InfinotedPluginReplacerRule*
+infinoted_plugin_replacer_table_lookup(
+  const InfinotedPluginReplacerTable* table,
+  const gchar* key,
+  gsize key_slen);
+
+void
+infinoted_plugin_replacer_table_mark_keys(
+  const InfinotedPluginReplacerTable* table,
+  const gchar* text,
+  gsize len,
+  gsize begin,
+  gsize end,
+  guint32* marks);
+
+G_END_DECLS
+
+#endif /* __INFINOTED_PLUGIN_REPLACER_TABLE_H__ */
+
+/* vim:set et sw=2 ts=2: */
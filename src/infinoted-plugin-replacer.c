@@ -43,24 +43,44 @@
 
 #include <libinftext/inf-text-session.h>
 #include <libinftext/inf-text-buffer.h>
+#include <libinftext/inf-text-default-buffer.h>
 
 #include <libinfinity/common/inf-request-result.h>
+#include <libinfinity/common/inf-browser.h>
 #include "inf-signals.h"
+#include "infinoted-plugin-replacer-core.h"
+#include "infinoted-plugin-replacer-record.h"
 //#include "inf-i18n.h"
 #include <string.h>
-#include <json-glib/json-glib.h>
 
 
 #define INFINOTED_PLUGIN_REPLACER_KEY_GROUP "replace-table"
+
+/* Milliseconds a session's scratch buffers may stay unused before they are
+ * shrunk back to INFINOTED_PLUGIN_REPLACER_SCRATCH_SIZE */
+#define INFINOTED_PLUGIN_REPLACER_SCRATCH_IDLE 30000
+/* Characters edited per second and connected user above which a session
+ * counts as a bulk edit rather than as typing, once the rate has held for
+ * more than a second. A single paste does not make a session bulk. */
+#define INFINOTED_PLUGIN_REPLACER_BULK_RATE 200
+/* Milliseconds runs of bulk edit sessions are delayed by, so that they
+ * replace larger batches of edits */
+#define INFINOTED_PLUGIN_REPLACER_BULK_DELAY 500
+
 typedef struct _InfinotedPluginReplacer InfinotedPluginReplacer;
 struct _InfinotedPluginReplacer {
   InfinotedPluginManager* manager;
   gchar* replace_table;
-  gchar** replace_words;
-  GKeyFile* replace_dict;
-  gsize replace_words_len;
-  JsonParser *parser;
-  JsonReader *reader;
+  InfinotedPluginReplacerTable* table;
+  gboolean shared_table;
+  gboolean incremental;
+  gboolean verify;
+  gint latency_report_interval;
+  InfIoTimeout* latency_report_timeout;
+  InfinotedPluginReplacerLatency interactive_latency;
+  InfinotedPluginReplacerLatency bulk_latency;
+  gchar* record_dir;
+  guint n_recordings;
 };
 
 typedef struct _InfinotedPluginReplacerSessionInfo
@@ -72,7 +92,20 @@ struct _InfinotedPluginReplacerSessionInfo {
   InfUser* user;
   InfTextBuffer* buffer;
   InfIoDispatch* dispatch;
+  InfIoTimeout* timeout; /* instead of dispatch, for bulk edit sessions */
+  gboolean bulk;
+  gint64 pending_since; /* first edit since the last run, or 0 */
+  /* Characters edited in the current second, and the number of seconds
+   * right before it in which more than the bulk rate was edited */
+  gint64 activity_start;
+  guint activity;
+  guint busy_seconds;
+  guint users; /* connected users, as of the last has_available_users */
   gboolean enabled;
+  InfinotedPluginReplacerScratch scratch;
+  gint64 scratch_last_used;
+  InfIoTimeout* shrink_timeout;
+  InfinotedPluginReplacerRecorder* recorder; /* if record-dir is set */
 };
 
 typedef struct _InfinotedPluginReplacerHasAvailableUsersData
@@ -80,6 +113,7 @@ typedef struct _InfinotedPluginReplacerHasAvailableUsersData
 struct _InfinotedPluginReplacerHasAvailableUsersData {
   InfUser* own_user;
   gboolean has_available_user;
+  guint n_available_users;
 };
 
 #include "infinoted-plugin-replacer.h"
@@ -89,9 +123,16 @@ infinoted_plugin_replacer_info_initialize(gpointer plugin_info){
   InfinotedPluginReplacer* plugin;
   plugin = (InfinotedPluginReplacer*)plugin_info;
   plugin->replace_table = g_strdup("");
-  plugin->replace_words = NULL;
-  plugin->parser = NULL;
-  plugin->reader = NULL;
+  plugin->table = NULL;
+  plugin->shared_table = FALSE;
+  plugin->incremental = TRUE;
+  plugin->verify = FALSE;
+  plugin->latency_report_interval = 600;
+  plugin->latency_report_timeout = NULL;
+  memset(&plugin->interactive_latency, 0, sizeof(plugin->interactive_latency));
+  memset(&plugin->bulk_latency, 0, sizeof(plugin->bulk_latency));
+  plugin->record_dir = NULL;
+  plugin->n_recordings = 0;
 }
 
 
@@ -105,43 +146,121 @@ infinoted_plugin_replacer_clean_key(gchar* key){
 }
 
 
+static void
+infinoted_plugin_replacer_latency_report(InfinotedPluginReplacer* plugin,
+                                         InfinotedPluginReplacerLatency* latency,
+                                         const gchar* kind)
+{
+  if(latency->total == 0)
+    return;
+
+  infinoted_log_info(
+    infinoted_plugin_manager_get_log(plugin->manager),
+    "Replacer latency of %s sessions: %" G_GUINT64_FORMAT " runs, "
+    "p50 %.1f ms, p99 %.1f ms, max %.1f ms",
+    kind,
+    latency->total,
+    infinoted_plugin_replacer_latency_percentile(latency, 50) / 1000.0,
+    infinoted_plugin_replacer_latency_percentile(latency, 99) / 1000.0,
+    latency->max / 1000.0
+  );
+
+  memset(latency, 0, sizeof(*latency));
+}
+
+/* Milliseconds between latency reports, as many as the timeout can take */
+static guint
+infinoted_plugin_replacer_latency_report_msecs(InfinotedPluginReplacer* plugin)
+{
+  return MIN((guint64)plugin->latency_report_interval * 1000, G_MAXUINT);
+}
+
+static void
+infinoted_plugin_replacer_latency_report_func(gpointer user_data)
+{
+  InfinotedPluginReplacer* plugin;
+  InfdDirectory* directory;
+
+  plugin = (InfinotedPluginReplacer*)user_data;
+
+  infinoted_plugin_replacer_latency_report(
+    plugin,
+    &plugin->interactive_latency,
+    "interactive"
+  );
+
+  infinoted_plugin_replacer_latency_report(
+    plugin,
+    &plugin->bulk_latency,
+    "bulk edit"
+  );
+
+  directory = infinoted_plugin_manager_get_directory(plugin->manager);
+
+  plugin->latency_report_timeout = inf_io_add_timeout(
+    infd_directory_get_io(directory),
+    infinoted_plugin_replacer_latency_report_msecs(plugin),
+    infinoted_plugin_replacer_latency_report_func,
+    plugin,
+    NULL
+  );
+}
+
 static gboolean
 infinoted_plugin_replacer_initialize(InfinotedPluginManager* manager,
                                        gpointer plugin_info,
                                        GError** error)
 {
   InfinotedPluginReplacer* plugin;
+  InfinotedLog* log;
   plugin = (InfinotedPluginReplacer*)plugin_info;
 
   plugin->manager = manager;
-  plugin->parser = json_parser_new ();
-  gboolean success = json_parser_load_from_file (plugin->parser,
-																							   plugin->replace_table,
-																						 		 error);
-  if (success == FALSE)
-		return success;
-  plugin->reader = json_reader_new (json_parser_get_root (plugin->parser));
-	plugin->replace_words = json_reader_list_members(plugin->reader);
-	if (NULL == plugin->replace_words)
+  log = infinoted_plugin_manager_get_log(manager);
+  plugin->table = infinoted_plugin_replacer_table_load(plugin->replace_table,
+                                                       plugin->shared_table,
+                                                       error);
+  if (plugin->table == NULL)
 		return FALSE;
-	plugin->replace_words_len = json_reader_count_members(plugin->reader);
-	//check for prefixes
-	int i;
-	for (i = 0; i < plugin->replace_words_len; i++){
-		int j;
-		for (j = 0; j <  plugin->replace_words_len; j++) {
-			if (i == j)
-				continue;
-			gchar* find = strstr(plugin->replace_words[j],
-			                     plugin->replace_words[i]);
-			if (find != NULL && find - plugin->replace_words[j] == 0){
-				g_set_error(error, 0, 0, "Error: '%s' is a prefix of '%s', \
-which is not allowed: a simple solution is to append a space.",
-				            plugin->replace_words[i], plugin->replace_words[j]);
-				return FALSE;
-			}
-		}
-	}	
+	switch (infinoted_plugin_replacer_table_get_source(plugin->table)){
+	case INFINOTED_PLUGIN_REPLACER_TABLE_PUBLISHED:
+		infinoted_log_info(log, "Replace table compiled into shared memory");
+		break;
+	case INFINOTED_PLUGIN_REPLACER_TABLE_ATTACHED:
+		infinoted_log_info(log, "Replace table attached from shared memory");
+		break;
+	default:
+		if (plugin->shared_table)
+			infinoted_log_warning(log, "Replace table not shared, using a private "
+			                      "copy: %s",
+			                      infinoted_plugin_replacer_table_get_share_error(
+			                        plugin->table));
+		break;
+	}
+	infinoted_log_info(log, "Replace table: %u rules in %" G_GSIZE_FORMAT " bytes",
+	                   infinoted_plugin_replacer_table_get_n_rules(plugin->table),
+	                   infinoted_plugin_replacer_table_get_size(plugin->table));
+	//rules without a string value are skipped by the runs
+	if (infinoted_plugin_replacer_table_get_n_ignored(plugin->table) > 0){
+		infinoted_log_warning(log, "Ignoring %u rules without a string value",
+		                      infinoted_plugin_replacer_table_get_n_ignored(
+		                        plugin->table));
+	}
+	if (plugin->incremental &&
+	    !infinoted_plugin_replacer_table_get_stable(plugin->table)){
+		infinoted_log_info(log, "Incremental rescans are not possible with this \
+replace table, documents will be rescanned as a whole after every edit");
+	}
+	if (plugin->latency_report_interval > 0){
+		InfdDirectory* directory = infinoted_plugin_manager_get_directory(manager);
+		plugin->latency_report_timeout = inf_io_add_timeout(
+			infd_directory_get_io(directory),
+			infinoted_plugin_replacer_latency_report_msecs(plugin),
+			infinoted_plugin_replacer_latency_report_func,
+			plugin,
+			NULL
+		);
+	}
 	return TRUE;
 }
 
@@ -150,25 +269,195 @@ infinoted_plugin_replacer_deinitialize(gpointer plugin_info)
 {
   InfinotedPluginReplacer* plugin;
   plugin = (InfinotedPluginReplacer*)plugin_info;
-  if (plugin->replace_words != NULL){
-		g_strfreev(plugin->replace_words);
+  if (plugin->latency_report_timeout != NULL){
+		InfdDirectory* directory =
+			infinoted_plugin_manager_get_directory(plugin->manager);
+		inf_io_remove_timeout(infd_directory_get_io(directory),
+		                      plugin->latency_report_timeout);
+		plugin->latency_report_timeout = NULL;
+	}
+  if (plugin->table != NULL){
+		infinoted_plugin_replacer_latency_report(plugin,
+		                                         &plugin->interactive_latency,
+		                                         "interactive");
+		infinoted_plugin_replacer_latency_report(plugin,
+		                                         &plugin->bulk_latency,
+		                                         "bulk edit");
+		infinoted_plugin_replacer_table_free(plugin->table);
 	}
   g_free(plugin->replace_table);
-  if(plugin->reader != NULL)
-		g_object_unref (plugin->reader);
-  if(plugin->parser != NULL)
-		g_object_unref (plugin->parser);
+  g_free(plugin->record_dir);
+}
+
+
+static void
+infinoted_plugin_replacer_scratch_shrink_func(gpointer user_data)
+{
+  InfinotedPluginReplacerSessionInfo* info;
+  InfdDirectory* directory;
+  gint64 idle;
+
+  info = (InfinotedPluginReplacerSessionInfo*)user_data;
+  info->shrink_timeout = NULL;
+
+  idle = (g_get_monotonic_time() - info->scratch_last_used) / 1000;
+  if(idle < INFINOTED_PLUGIN_REPLACER_SCRATCH_IDLE)
+  {
+    /* The session has been used in the meanwhile, check again later */
+    directory = infinoted_plugin_manager_get_directory(info->plugin->manager);
+
+    info->shrink_timeout = inf_io_add_timeout(
+      infd_directory_get_io(directory),
+      INFINOTED_PLUGIN_REPLACER_SCRATCH_IDLE - idle,
+      infinoted_plugin_replacer_scratch_shrink_func,
+      info,
+      NULL
+    );
+  }
+  else
+  {
+    /* Fresh buffers of the initial size, see
+     * infinoted_plugin_replacer_scratch_get_size(). The next run reads the
+     * whole buffer again. */
+    infinoted_plugin_replacer_scratch_release(&info->scratch);
+    infinoted_plugin_replacer_scratch_init(&info->scratch);
+  }
+}
+
+static void
+infinoted_plugin_replacer_scratch_touch(InfinotedPluginReplacerSessionInfo* info)
+{
+  InfinotedPluginReplacerScratch* scratch;
+  InfdDirectory* directory;
+  gsize size;
+
+  scratch = &info->scratch;
+  info->scratch_last_used = g_get_monotonic_time();
+
+  size = infinoted_plugin_replacer_scratch_get_size(scratch);
+  if(size > scratch->high_water)
+    scratch->high_water = size;
+
+  /* Buffers grown by a large document or by many matches stay that large
+   * even when the document is shrunk again */
+  if(info->shrink_timeout == NULL &&
+     size > scratch->initial_size + INFINOTED_PLUGIN_REPLACER_SCRATCH_SIZE)
+  {
+    directory = infinoted_plugin_manager_get_directory(info->plugin->manager);
+
+    info->shrink_timeout = inf_io_add_timeout(
+      infd_directory_get_io(directory),
+      INFINOTED_PLUGIN_REPLACER_SCRATCH_IDLE,
+      infinoted_plugin_replacer_scratch_shrink_func,
+      info,
+      NULL
+    );
+  }
 }
 
+/* Copies the document of info into a new buffer, for the reference run */
+static InfTextBuffer*
+infinoted_plugin_replacer_verify_begin(InfinotedPluginReplacerSessionInfo* info)
+{
+  InfTextBuffer* reference;
+  InfTextChunk* chunk;
+
+  reference = INF_TEXT_BUFFER(
+    inf_text_default_buffer_new(inf_text_buffer_get_encoding(info->buffer))
+  );
+
+  chunk = inf_text_buffer_get_slice(
+    info->buffer,
+    0,
+    inf_text_buffer_get_length(info->buffer)
+  );
+
+  inf_text_buffer_insert_chunk(reference, 0, chunk, info->user);
+  inf_text_chunk_free(chunk);
+  return reference;
+}
+
+/* Does the reference run on the copy made before the run of info, and
+ * compares the results. If they differ, the plugin falls back to full
+ * rescans, which are the closest to the reference. */
+static void
+infinoted_plugin_replacer_verify_end(InfinotedPluginReplacerSessionInfo* info,
+                                     InfTextBuffer* reference,
+                                     guint operations)
+{
+  InfTextChunk* chunk;
+  InfTextChunk* reference_chunk;
+  gchar* text;
+  gchar* reference_text;
+  gsize bytes;
+  gsize reference_bytes;
+  guint reference_operations;
+
+  reference_operations = infinoted_plugin_replacer_core_run_reference(
+    info->plugin->table,
+    reference,
+    info->user
+  );
+
+  chunk = inf_text_buffer_get_slice(
+    info->buffer,
+    0,
+    inf_text_buffer_get_length(info->buffer)
+  );
+
+  reference_chunk = inf_text_buffer_get_slice(
+    reference,
+    0,
+    inf_text_buffer_get_length(reference)
+  );
+
+  text = inf_text_chunk_get_text(chunk, &bytes);
+  reference_text = inf_text_chunk_get_text(reference_chunk, &reference_bytes);
+
+  if(operations != reference_operations ||
+     bytes != reference_bytes ||
+     memcmp(text, reference_text, bytes) != 0)
+  {
+    infinoted_log_warning(
+      infinoted_plugin_manager_get_log(info->plugin->manager),
+      "Replacer run differs from the reference run: %u operations for "
+      "%" G_GSIZE_FORMAT " bytes instead of %u operations for "
+      "%" G_GSIZE_FORMAT " bytes. Falling back to full rescans.",
+      operations,
+      bytes,
+      reference_operations,
+      reference_bytes
+    );
+
+    /* Every session, not only this one, reads its whole buffer again
+     * on its next run */
+    info->plugin->incremental = FALSE;
+    info->scratch.synced = FALSE;
+  }
+
+  g_free(text);
+  g_free(reference_text);
+  inf_text_chunk_free(chunk);
+  inf_text_chunk_free(reference_chunk);
+  g_object_unref(reference);
+}
 
 static void
 infinoted_plugin_replacer_run(InfinotedPluginReplacerSessionInfo* info)
 {
 	//block text-insert and text-erase signal dispatch
 
+	//the user can have left between scheduling and running
+	if (info->user == NULL)
+		return;
+	if (info->recorder != NULL)
+		infinoted_plugin_replacer_recorder_run(info->recorder);
 	infinoted_plugin_replacer_check_enabled(info);  
-	if (FALSE == info->enabled)
+	if (FALSE == info->enabled){
+		//the scratch text is not kept up to date for disabled documents
+		info->scratch.synced = FALSE;
 		return;
+	}
 	g_signal_handlers_block_by_func(
     info->buffer,
     G_CALLBACK(infinoted_plugin_replacer_text_inserted_cb),
@@ -179,63 +468,18 @@ infinoted_plugin_replacer_run(InfinotedPluginReplacerSessionInfo* info)
     G_CALLBACK(infinoted_plugin_replacer_text_erased_cb),
     info
   );
-  //guint substitutions = 0; //conto delle sostituzioni, per evitare
-														 //ricorsioni disastrose
-	InfTextBuffer* buf = info->buffer;
-
-
-  //foreach replace_words
-  guint i = 0;
-  const GError* err;
-	for (i = 0; i < info->plugin->replace_words_len; i++) {
-		gint diff = 0;
-		//foreach word the buffer must be re-read to allow nested macros
-		InfTextChunk* chunk = inf_text_buffer_get_slice(buf,
-																										0,
-																										inf_text_buffer_get_length(buf));
-		gsize out_len;
-		gchar* buf_str = inf_text_chunk_get_text(chunk, &out_len);
-		gchar* tmp_buf_str = buf_str;
-		//get key string
-		gchar* key = g_strdup(info->plugin->replace_words[i]);	//g_strdup because it will be modified
-		guint key_slen = strlen(key);
-		guint key_ulen = g_utf8_strlen(key, -1);
-		//get val string
-		json_reader_read_member(info->plugin->reader, key);
-		const gchar* val = json_reader_get_string_value (info->plugin->reader);
-		
-		if (NULL != (err = json_reader_get_error(info->plugin->reader))){
-			g_print("ERROR: %s\n", err->message);
-			json_reader_set_root(info->plugin->reader,json_parser_get_root (info->plugin->parser));
-		}
-		json_reader_end_member(info->plugin->reader);
-		if (val != NULL) {
-
-			guint val_slen = strlen(val);
-			guint val_ulen = g_utf8_strlen(val, -1);
-						
-			//get position, if present
-			while (NULL != (tmp_buf_str = g_strstr_len(tmp_buf_str, -1, key))) {
-				//InfinotedLog* log = infinoted_plugin_manager_get_log(info->plugin->manager);
-				/*		infinoted_log_info(
-						log,
-						"rule: %s", key);*/
-				//g_strstr_len returns a pointer to the location of key
-				//however we need the character count to the location
-				glong offset = g_utf8_pointer_to_offset (buf_str, tmp_buf_str);
-				offset += diff;
-				diff += val_ulen - key_ulen;
-				//replace
-				inf_text_buffer_insert_text(buf, offset,val,val_slen, val_ulen, info->user);
-				inf_text_buffer_erase_text(buf, offset + val_ulen, key_ulen, info->user);
-				tmp_buf_str += strlen(key);
-			}
-		}
-		inf_text_chunk_free(chunk);
-		g_free(buf_str);
-		g_free(key);
-		//g_free(val);
-	}
+	InfinotedPluginReplacer* plugin = info->plugin;
+	InfTextBuffer* reference = NULL;
+	if (plugin->verify)
+		reference = infinoted_plugin_replacer_verify_begin(info);
+	guint operations = infinoted_plugin_replacer_core_run(&info->scratch,
+	                                                      plugin->table,
+	                                                      plugin->incremental,
+	                                                      info->buffer,
+	                                                      info->user);
+	infinoted_plugin_replacer_scratch_touch(info);
+	if (reference != NULL)
+		infinoted_plugin_replacer_verify_end(info, reference, operations);
 	g_signal_handlers_unblock_by_func(
     info->buffer,
     G_CALLBACK(infinoted_plugin_replacer_text_inserted_cb),
@@ -248,6 +492,33 @@ infinoted_plugin_replacer_run(InfinotedPluginReplacerSessionInfo* info)
   );
 }
 
+static void
+infinoted_plugin_replacer_run_scheduled(
+  InfinotedPluginReplacerSessionInfo* info)
+{
+  InfinotedPluginReplacerLatency* latency;
+  gint64 pending_since;
+
+  pending_since = info->pending_since;
+  info->pending_since = 0;
+
+  infinoted_plugin_replacer_run(info);
+
+  /* Documents where the replacer is off are not waiting for anything */
+  if(pending_since != 0 && info->enabled)
+  {
+    if(info->bulk)
+      latency = &info->plugin->bulk_latency;
+    else
+      latency = &info->plugin->interactive_latency;
+
+    infinoted_plugin_replacer_latency_add(
+      latency,
+      g_get_monotonic_time() - pending_since
+    );
+  }
+}
+
 static void
 infinoted_plugin_replacer_run_dispatch_func(gpointer user_data)
 {
@@ -256,35 +527,89 @@ infinoted_plugin_replacer_run_dispatch_func(gpointer user_data)
 
   info->dispatch = NULL;
 
-  infinoted_plugin_replacer_run(info);
+  infinoted_plugin_replacer_run_scheduled(info);
+}
+
+static void
+infinoted_plugin_replacer_run_timeout_func(gpointer user_data)
+{
+  InfinotedPluginReplacerSessionInfo* info;
+  info = (InfinotedPluginReplacerSessionInfo*)user_data;
+
+  info->timeout = NULL;
+
+  infinoted_plugin_replacer_run_scheduled(info);
+}
+
+/* Schedules a run after len characters have been edited. Sessions where
+ * people type get their run dispatched right away. Sessions seeing more
+ * edits than their users could type, such as imports, get it delayed, so
+ * that they do not hold up the others and replace larger batches. */
+static void
+infinoted_plugin_replacer_schedule(InfinotedPluginReplacerSessionInfo* info,
+                                   guint len)
+{
+  InfdDirectory* directory;
+  gint64 now;
+  guint rate;
+
+  now = g_get_monotonic_time();
+  rate = INFINOTED_PLUGIN_REPLACER_BULK_RATE * MAX(info->users, 1);
+  if(now - info->activity_start >= G_USEC_PER_SEC)
+  {
+    /* A second without edits in between ends the streak */
+    if(now - info->activity_start < 2 * G_USEC_PER_SEC &&
+       info->activity > rate)
+    {
+      ++info->busy_seconds;
+    }
+    else
+    {
+      info->busy_seconds = 0;
+    }
+
+    info->activity = 0;
+    info->activity_start = now;
+  }
+
+  info->activity += len;
+  if(info->pending_since == 0)
+    info->pending_since = now;
+
+  if(info->dispatch != NULL || info->timeout != NULL)
+    return;
+
+  directory = infinoted_plugin_manager_get_directory(info->plugin->manager);
+  info->bulk = info->busy_seconds >= 2 ||
+    (info->busy_seconds == 1 && info->activity > rate);
+
+  if(info->bulk)
+  {
+    info->timeout = inf_io_add_timeout(
+      infd_directory_get_io(directory),
+      INFINOTED_PLUGIN_REPLACER_BULK_DELAY,
+      infinoted_plugin_replacer_run_timeout_func,
+      info,
+      NULL
+    );
+  }
+  else
+  {
+    info->dispatch = inf_io_add_dispatch(
+      infd_directory_get_io(directory),
+      infinoted_plugin_replacer_run_dispatch_func,
+      info,
+      NULL
+    );
+  }
 }
 
 static void
 infinoted_plugin_replacer_check_enabled(InfinotedPluginReplacerSessionInfo* info)
 {
-	InfTextBuffer* buffer = info->buffer;
-	//Magic string to use at the beginning of the file
-  gchar* magic_string = "#replacer on\n";
-  guint magic_string_length = strlen(magic_string);
   gboolean oldval = info->enabled;
-  guint buffer_length = inf_text_buffer_get_length(buffer);
-  info->enabled = FALSE;
-  if (buffer_length > magic_string_length){
-		InfTextChunk* inizio = inf_text_buffer_get_slice(buffer, 0, magic_string_length);
-		gsize real_len = inf_text_chunk_get_length(inizio);
-		gchar* inizio_chars = inf_text_chunk_get_text(inizio, &real_len);
-		//inizio_chars non è nul_terminated come invece strcmp richiede
-		gchar nul_terminated[magic_string_length+1];
-		memcpy(nul_terminated, inizio_chars, magic_string_length);
-		nul_terminated[magic_string_length]='\0';
-				
-		if (0 == g_strcmp0(nul_terminated, magic_string)) {
-			info->enabled = TRUE;
-		}
-		g_free(inizio_chars);
-		inf_text_chunk_free(inizio);
-		//g_object_unref(log);
-	} 
+  info->enabled = infinoted_plugin_replacer_core_check_enabled(&info->scratch,
+                                                               info->buffer);
 	
 	if(oldval != info->enabled){
 		InfinotedLog* log = infinoted_plugin_manager_get_log(info->plugin->manager);
@@ -308,20 +633,11 @@ infinoted_plugin_replacer_text_inserted_cb(InfTextBuffer* buffer,
   info = (InfinotedPluginReplacerSessionInfo*)user_data;
   
 
-  //check enabled
-  InfdDirectory* directory;
-	
-  if(info->dispatch == NULL)
-  {
-    directory = infinoted_plugin_manager_get_directory(info->plugin->manager);
+  if(info->recorder != NULL)
+    infinoted_plugin_replacer_recorder_insert(info->recorder, pos, chunk, user);
 
-    info->dispatch = inf_io_add_dispatch(
-      infd_directory_get_io(directory),
-      infinoted_plugin_replacer_run_dispatch_func,
-      info,
-      NULL
-    );
-  }
+  infinoted_plugin_replacer_scratch_text_inserted(&info->scratch, pos, chunk);
+  infinoted_plugin_replacer_schedule(info, inf_text_chunk_get_length(chunk));
 }
 
 static void
@@ -332,22 +648,36 @@ infinoted_plugin_replacer_text_erased_cb(InfTextBuffer* buffer,
                                            gpointer user_data)
 {
   InfinotedPluginReplacerSessionInfo* info;
+  info = (InfinotedPluginReplacerSessionInfo*)user_data;
+
+  if(info->recorder != NULL)
+    infinoted_plugin_replacer_recorder_erase(info->recorder, pos, chunk, user);
+
+  infinoted_plugin_replacer_scratch_text_erased(&info->scratch, pos, chunk);
+  infinoted_plugin_replacer_schedule(info, inf_text_chunk_get_length(chunk));
+}
+
+/* Drops the run scheduled for info, if any */
+static void
+infinoted_plugin_replacer_cancel_run(InfinotedPluginReplacerSessionInfo* info)
+{
   InfdDirectory* directory;
 
-  info = (InfinotedPluginReplacerSessionInfo*)user_data;
+  directory = infinoted_plugin_manager_get_directory(info->plugin->manager);
 
-  
-  if(info->dispatch == NULL)
+  if(info->dispatch != NULL)
   {
-    directory = infinoted_plugin_manager_get_directory(info->plugin->manager);
+    inf_io_remove_dispatch(infd_directory_get_io(directory), info->dispatch);
+    info->dispatch = NULL;
+  }
 
-    info->dispatch = inf_io_add_dispatch(
-      infd_directory_get_io(directory),
-      infinoted_plugin_replacer_run_dispatch_func,
-      info,
-      NULL
-    );
+  if(info->timeout != NULL)
+  {
+    inf_io_remove_timeout(infd_directory_get_io(directory), info->timeout);
+    info->timeout = NULL;
   }
+
+  info->pending_since = 0;
 }
 
 static void
@@ -363,6 +693,11 @@ infinoted_plugin_replacer_remove_user(
   user = info->user;
   info->user = NULL;
 
+  /* Edits are not seen anymore until the user joins again, and a pending
+   * run would have nobody to make its changes on behalf of */
+  info->scratch.synced = FALSE;
+  infinoted_plugin_replacer_cancel_run(info);
+
   g_object_get(G_OBJECT(info->proxy), "session", &session, NULL); 
 
   inf_session_set_user_status(session, user, INF_USER_UNAVAILABLE);
@@ -396,6 +731,7 @@ infinoted_plugin_replacer_has_available_users_foreach_func(InfUser* user,
      (inf_user_get_flags(user) & INF_USER_LOCAL) == 0)
   {
     data->has_available_user = TRUE;
+    ++data->n_available_users;
   }
 }
 
@@ -411,6 +747,7 @@ infinoted_plugin_replacer_has_available_users(
   user_table = inf_session_get_user_table(session);
 
   data.has_available_user = FALSE;
+  data.n_available_users = 0;
   data.own_user = info->user;
 
   inf_user_table_foreach_user(
@@ -420,6 +757,7 @@ infinoted_plugin_replacer_has_available_users(
   );
 
   g_object_unref(session);
+  info->users = data.n_available_users;
   return data.has_available_user;
 }
 
@@ -451,6 +789,10 @@ infinoted_plugin_replacer_user_join_cb(InfRequest* request,
     info->user = user;
     g_object_ref(info->user);
 
+    /* Edits made while no user was joined have not been seen */
+    if(info->recorder != NULL)
+      infinoted_plugin_replacer_recorder_snapshot(info->recorder, info->buffer);
+
     /* Initial run */
     infinoted_plugin_replacer_run(info);
 
@@ -553,6 +895,52 @@ infinoted_plugin_replacer_remove_available_user_cb(InfUserTable* user_table,
   }
 }
 
+/* Records the edits of the document at iter into a new file in the
+ * record-dir directory, named after the path of the document */
+static void
+infinoted_plugin_replacer_start_recording(
+  InfinotedPluginReplacerSessionInfo* info,
+  const InfBrowserIter* iter)
+{
+  InfinotedPluginReplacer* plugin;
+  InfdDirectory* directory;
+  gchar* path;
+  gchar* basename;
+  gchar* filename;
+  GError* error;
+
+  plugin = info->plugin;
+  directory = infinoted_plugin_manager_get_directory(plugin->manager);
+  path = inf_browser_get_path(INF_BROWSER(directory), iter);
+  g_strdelimit(path, "/", '_');
+
+  basename = g_strdup_printf(
+    "%s-%" G_GINT64_FORMAT "-%u.rec",
+    path + 1,
+    g_get_real_time() / G_USEC_PER_SEC,
+    ++plugin->n_recordings
+  );
+
+  filename = g_build_filename(plugin->record_dir, basename, NULL);
+
+  error = NULL;
+  info->recorder = infinoted_plugin_replacer_recorder_new(filename, &error);
+  if(info->recorder == NULL)
+  {
+    infinoted_log_warning(
+      infinoted_plugin_manager_get_log(plugin->manager),
+      "%s",
+      error->message
+    );
+
+    g_error_free(error);
+  }
+
+  g_free(filename);
+  g_free(basename);
+  g_free(path);
+}
+
 static void
 infinoted_plugin_replacer_session_added(const InfBrowserIter* iter,
                                           InfSessionProxy* proxy,
@@ -570,9 +958,24 @@ infinoted_plugin_replacer_session_added(const InfBrowserIter* iter,
   info->request = NULL;
   info->user = NULL;
   info->dispatch = NULL;
+  info->timeout = NULL;
+  info->bulk = FALSE;
+  info->pending_since = 0;
+  info->activity_start = 0;
+  info->activity = 0;
+  info->busy_seconds = 0;
+  info->users = 0;
   info->enabled = FALSE;
+  infinoted_plugin_replacer_scratch_init(&info->scratch);
+  info->scratch.high_water = 0;
+  info->scratch_last_used = 0;
+  info->shrink_timeout = NULL;
+  info->recorder = NULL;
   g_object_ref(proxy);
 
+  if(info->plugin->record_dir != NULL)
+    infinoted_plugin_replacer_start_recording(info, iter);
+
   g_object_get(G_OBJECT(proxy), "session", &session, NULL);
   g_assert(inf_session_get_status(session) == INF_SESSION_RUNNING);
   info->buffer = INF_TEXT_BUFFER(inf_session_get_buffer(session));
@@ -612,8 +1015,10 @@ infinoted_plugin_replacer_session_removed(const InfBrowserIter* iter,
   InfdDirectory* directory;
   InfSession* session;
   InfUserTable* user_table;
+  GError* error;
 
   info = (InfinotedPluginReplacerSessionInfo*)session_info;
+  error = NULL;
 
   g_object_get(G_OBJECT(info->proxy), "session", &session, NULL);
   user_table = inf_session_get_user_table(session);
@@ -630,16 +1035,41 @@ infinoted_plugin_replacer_session_removed(const InfBrowserIter* iter,
     info
   );
 
-  if(info->dispatch != NULL)
+  infinoted_plugin_replacer_cancel_run(info);
+
+  if(info->user != NULL)
+  {
+    infinoted_plugin_replacer_remove_user(info);
+  }
+
+  if(info->shrink_timeout != NULL)
   {
     directory = infinoted_plugin_manager_get_directory(info->plugin->manager);
-    inf_io_remove_dispatch(infd_directory_get_io(directory), info->dispatch);
-    info->dispatch = NULL;
+    inf_io_remove_timeout(infd_directory_get_io(directory), info->shrink_timeout);
+    info->shrink_timeout = NULL;
   }
 
-  if(info->user != NULL)
+  infinoted_log_info(
+    infinoted_plugin_manager_get_log(info->plugin->manager),
+    "Replacer scratch high-water mark: %" G_GSIZE_FORMAT " bytes",
+    info->scratch.high_water
+  );
+  infinoted_plugin_replacer_scratch_release(&info->scratch);
+
+  if(info->recorder != NULL)
   {
-    infinoted_plugin_replacer_remove_user(info);
+    if(!infinoted_plugin_replacer_recorder_free(info->recorder, &error))
+    {
+      infinoted_log_warning(
+        infinoted_plugin_manager_get_log(info->plugin->manager),
+        "%s",
+        error->message
+      );
+
+      g_error_free(error);
+    }
+
+    info->recorder = NULL;
   }
 
   if(info->buffer != NULL)
@@ -675,6 +1105,57 @@ static const InfinotedParameterInfo INFINOTED_PLUGIN_REPLACER_OPTIONS[] = {
     0,
     "File to be used as a replace table.",
     "RTABLE"
+  }, {
+    "shared-table",
+    INFINOTED_PARAMETER_BOOLEAN,
+    0,
+    G_STRUCT_OFFSET(InfinotedPluginReplacer, shared_table),
+    infinoted_parameter_convert_boolean,
+    0,
+    "Whether to share the compiled replace table with other infinoted \
+instances on this host that load the same table. Defaults to false.",
+    NULL
+  }, {
+    "incremental",
+    INFINOTED_PARAMETER_BOOLEAN,
+    0,
+    G_STRUCT_OFFSET(InfinotedPluginReplacer, incremental),
+    infinoted_parameter_convert_boolean,
+    0,
+    "Whether to only rescan the edited parts of documents, if the replace \
+table allows it. Defaults to true.",
+    NULL
+  }, {
+    "verify",
+    INFINOTED_PARAMETER_BOOLEAN,
+    0,
+    G_STRUCT_OFFSET(InfinotedPluginReplacer, verify),
+    infinoted_parameter_convert_boolean,
+    0,
+    "Whether to check every run against the original, slow algorithm. \
+Meant for debugging only. Defaults to false.",
+    NULL
+  }, {
+    "latency-report-interval",
+    INFINOTED_PARAMETER_INT,
+    0,
+    G_STRUCT_OFFSET(InfinotedPluginReplacer, latency_report_interval),
+    infinoted_parameter_convert_nonnegative,
+    0,
+    "Interval in seconds in which to log the replacement latencies of \
+interactive and bulk edit sessions, or 0 to log them at shutdown only. \
+Defaults to 600.",
+    "SECONDS"
+  }, {
+    "record-dir",
+    INFINOTED_PARAMETER_STRING,
+    0,
+    G_STRUCT_OFFSET(InfinotedPluginReplacer, record_dir),
+    infinoted_parameter_convert_filename,
+    0,
+    "Directory to record the edits of every document to, for replaying \
+them with infinoted-replacer-replay. Defaults to not recording.",
+    "DIRECTORY"
   }, {
     NULL,
     0,
@@ -0,0 +1,322 @@
+/*
+ * infinoted-plugin-replacer - a real-time replacer for text sessions
+ * on an infinoted server.
+ * Copyright (C) 2016 Pietro Brenna <pietrobrenna@zoho.com>
+ * Copyright (C) 2016 Alessandro Bregoli <>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+*/
+
+/* Compares the memory use and the lookup speed of the packed replace
+ * table with those of the json-glib tree the plugin used to keep. */
+
+#include "infinoted-plugin-replacer-table.h"
+
+#include <json-glib/json-glib.h>
+#include <glib/gstdio.h>
+
+#include <malloc.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Lookups of every key done for each layout, at least */
+#define INFINOTED_REPLACER_BENCH_LOOKUPS 2000000
+
+static gint bench_rules = 2000;
+/* Sum of the values looked up, which keeps the lookups from being
+ * optimized away */
+static volatile guint64 bench_checksum;
+
+static const GOptionEntry INFINOTED_REPLACER_BENCH_OPTIONS[] = {
+  {
+    "rules", 'n', 0, G_OPTION_ARG_INT, &bench_rules,
+    "Number of rules of the generated table, if no TABLE is given "
+    "(default 2000)", "N"
+  }, {
+    NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL
+  }
+};
+
+/* Returns the number of bytes allocated from the heap */
+static gsize
+infinoted_replacer_bench_heap(void)
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+  return mallinfo2().uordblks;
+#else
+  return (guint)mallinfo().uordblks;
+#endif
+}
+
+/* Writes a table of n_rules LaTeX style rules into a temporary file */
+static gchar*
+infinoted_replacer_bench_make_table(guint n_rules,
+                                    GError** error)
+{
+  GString* json;
+  gchar* filename;
+  gboolean result;
+  gint fd;
+  guint i;
+
+  fd = g_file_open_tmp("infinoted-replacer-bench-XXXXXX.json", &filename,
+                       error);
+  if(fd == -1)
+    return NULL;
+
+  close(fd);
+
+  json = g_string_new("{\n");
+  for(i = 0; i < n_rules; ++i)
+  {
+    /* Keys of the same length, so that none is a prefix of another, and
+     * values with non-ASCII characters, as most replace tables have */
+    g_string_append_printf(
+      json,
+      "  \"\\\\symbol%08u\": \"\xe2\x9f\xa8%u\xe2\x9f\xa9\"%s\n",
+      i,
+      i,
+      i + 1 < n_rules ? "," : ""
+    );
+  }
+  g_string_append(json, "}\n");
+
+  result = g_file_set_contents(filename, json->str, json->len, error);
+  g_string_free(json, TRUE);
+
+  if(!result)
+  {
+    g_unlink(filename);
+    g_free(filename);
+    return NULL;
+  }
+
+  return filename;
+}
+
+static void
+infinoted_replacer_bench_print(const gchar* name,
+                               gsize bytes,
+                               guint n_rules,
+                               guint64 lookups,
+                               gint64 usec)
+{
+  g_print(
+    "%s: %" G_GSIZE_FORMAT " bytes (%.1f bytes/rule), %.2f million "
+    "lookups/s\n",
+    name,
+    bytes,
+    bytes / (gdouble)MAX(n_rules, 1),
+    lookups / (gdouble)MAX(usec, 1)
+  );
+}
+
+/* The plugin used to keep the parser and a reader of the table, and to
+ * read the value of every key from the reader in every run */
+static gboolean
+infinoted_replacer_bench_tree(const gchar* filename,
+                              GError** error)
+{
+  JsonParser* parser;
+  JsonReader* reader;
+  gchar** members;
+  const gchar* val;
+  guint64 lookups;
+  guint64 checksum;
+  guint n_rules;
+  guint i;
+  gsize heap;
+  gint64 start;
+  gint64 end;
+
+  heap = infinoted_replacer_bench_heap();
+
+  parser = json_parser_new();
+  if(!json_parser_load_from_file(parser, filename, error))
+  {
+    g_object_unref(parser);
+    return FALSE;
+  }
+
+  reader = json_reader_new(json_parser_get_root(parser));
+  members = json_reader_list_members(reader);
+  n_rules = json_reader_count_members(reader);
+
+  heap = infinoted_replacer_bench_heap() - heap;
+
+  lookups = 0;
+  checksum = 0;
+  start = g_get_monotonic_time();
+  while(lookups < INFINOTED_REPLACER_BENCH_LOOKUPS && n_rules > 0)
+  {
+    for(i = 0; i < n_rules; ++i)
+    {
+      json_reader_read_member(reader, members[i]);
+      val = json_reader_get_string_value(reader);
+      if(val != NULL)
+        checksum += val[0];
+      json_reader_end_member(reader);
+    }
+
+    lookups += n_rules;
+  }
+  end = g_get_monotonic_time();
+
+  infinoted_replacer_bench_print("json-glib tree", heap, n_rules, lookups,
+                                 end - start);
+
+  g_strfreev(members);
+  g_object_unref(reader);
+  g_object_unref(parser);
+
+  bench_checksum += checksum;
+  return TRUE;
+}
+
+static gboolean
+infinoted_replacer_bench_packed(const gchar* filename,
+                                GError** error)
+{
+  InfinotedPluginReplacerTable* table;
+  const InfinotedPluginReplacerRule* rule;
+  const gchar** keys;
+  gsize* key_slens;
+  guint64 lookups;
+  guint64 checksum;
+  guint n_rules;
+  guint i;
+  gsize heap;
+  gint64 start;
+  gint64 end;
+
+  heap = infinoted_replacer_bench_heap();
+  table = infinoted_plugin_replacer_table_load(filename, FALSE, error);
+  if(table == NULL)
+    return FALSE;
+  heap = infinoted_replacer_bench_heap() - heap;
+
+  /* Looked up by copies of the keys, as in a document */
+  n_rules = infinoted_plugin_replacer_table_get_n_rules(table);
+  keys = g_new(const gchar*, n_rules);
+  key_slens = g_new(gsize, n_rules);
+  for(i = 0; i < n_rules; ++i)
+  {
+    rule = infinoted_plugin_replacer_table_get_rule(table, i);
+    keys[i] = g_strdup(infinoted_plugin_replacer_table_get_key(table, rule));
+    key_slens[i] = rule->key_slen;
+  }
+
+  lookups = 0;
+  checksum = 0;
+  start = g_get_monotonic_time();
+  while(lookups < INFINOTED_REPLACER_BENCH_LOOKUPS && n_rules > 0)
+  {
+    for(i = 0; i < n_rules; ++i)
+    {
+      rule = infinoted_plugin_replacer_table_lookup(table, keys[i],
+                                                    key_slens[i]);
+      if(rule != NULL)
+        checksum += infinoted_plugin_replacer_table_get_value(table, rule)[0];
+    }
+
+    lookups += n_rules;
+  }
+  end = g_get_monotonic_time();
+
+  infinoted_replacer_bench_print("packed table", heap, n_rules, lookups,
+                                 end - start);
+  g_print(
+    "  of which the table itself: %" G_GSIZE_FORMAT " bytes\n",
+    infinoted_plugin_replacer_table_get_size(table)
+  );
+
+  for(i = 0; i < n_rules; ++i)
+    g_free((gchar*)keys[i]);
+  g_free(keys);
+  g_free(key_slens);
+  infinoted_plugin_replacer_table_free(table);
+
+  bench_checksum += checksum;
+  return TRUE;
+}
+
+int
+main(int argc,
+     char* argv[])
+{
+  GOptionContext* context;
+  GError* error;
+  gchar* filename;
+  gboolean result;
+
+  /* Count the nodes of the tree as they are, not GSlice magazines */
+  g_setenv("G_SLICE", "always-malloc", TRUE);
+
+  error = NULL;
+  context = g_option_context_new("[TABLE]");
+  g_option_context_set_summary(
+    context,
+    "Measures the memory taken by a replace table and the time it takes "
+    "to look up its keys, for the packed table of the plugin and for the "
+    "json-glib tree it replaces. Without TABLE, a table is generated."
+  );
+
+  g_option_context_add_main_entries(
+    context,
+    INFINOTED_REPLACER_BENCH_OPTIONS,
+    NULL
+  );
+
+  if(!g_option_context_parse(context, &argc, &argv, &error))
+  {
+    g_printerr("%s\n", error->message);
+    g_error_free(error);
+    g_option_context_free(context);
+    return 1;
+  }
+
+  g_option_context_free(context);
+
+  if(argc > 2)
+  {
+    g_printerr("Usage: %s [OPTION...] [TABLE]\n", argv[0]);
+    return 1;
+  }
+
+  if(argc == 2)
+    filename = g_strdup(argv[1]);
+  else
+    filename = infinoted_replacer_bench_make_table(MAX(bench_rules, 1),
+                                                   &error);
+
+  result = filename != NULL &&
+    infinoted_replacer_bench_tree(filename, &error) &&
+    infinoted_replacer_bench_packed(filename, &error);
+
+  if(!result)
+  {
+    g_printerr("%s\n", error->message);
+    g_error_free(error);
+  }
+
+  if(filename != NULL && argc != 2)
+    g_unlink(filename);
+  g_free(filename);
+
+  return result ? 0 : 1;
+}
+
+/* vim:set et sw=2 ts=2: */
@@ -0,0 +1,685 @@
+/*
+ * infinoted-plugin-replacer - a real-time replacer for text sessions
+ * on an infinoted server.
+ * Copyright (C) 2016 Pietro Brenna <pietrobrenna@zoho.com>
+ * Copyright (C) 2016 Alessandro Bregoli <>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+*/
+
+/* Checks infinoted_plugin_replacer_core_run() against the original
+ * algorithm on random replace tables, documents and edits, and its runs
+ * around the edits against full rescans. With
+ * INFINOTED_REPLACER_CHECK_FUZZ defined it is built as a libFuzzer target
+ * instead, where the fuzzer input makes the random choices. */
+
+#include "infinoted-plugin-replacer-core.h"
+#include "infinoted-plugin-replacer-table.h"
+
+#include <libinftext/inf-text-default-buffer.h>
+
+#include <glib/gstdio.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Rules of a table, at most */
+#define INFINOTED_REPLACER_CHECK_MAX_RULES 24
+/* Length of a document, in characters, after which a case ends. Tables
+ * whose replacements produce keys of earlier rules grow the document at
+ * every run. */
+#define INFINOTED_REPLACER_CHECK_MAX_LENGTH 2000
+
+/* What keys, values and documents are made of: ASCII, characters of two,
+ * three and four bytes (é, α, → and 𝔸), and characters which need to be
+ * escaped in JSON */
+static const gchar* const INFINOTED_REPLACER_CHECK_SYMBOLS[] = {
+  "a", "b", "c", " ", "\n", "\"", "\\",
+  "\xc3\xa9", "\xce\xb1", "\xe2\x86\x92", "\xf0\x9d\x94\xb8"
+};
+
+/* What the values of tables with marked keys are made of besides keys:
+ * characters no key contains (X, ä, € and 😀) */
+static const gchar* const INFINOTED_REPLACER_CHECK_VALUE_SYMBOLS[] = {
+  "X", "\xc3\xa4", "\xe2\x82\xac", "\xf0\x9f\x98\x80"
+};
+
+/* Where the random choices come from */
+typedef struct _InfinotedReplacerCheckSource InfinotedReplacerCheckSource;
+struct _InfinotedReplacerCheckSource {
+  GRand* rand; /* NULL if the choices are read from data */
+  const guchar* data;
+  gsize size;
+  gsize pos;
+};
+
+/* A replace table applied to the same document three times: by
+ * infinoted_plugin_replacer_core_run() rescanning around the edits in
+ * buffer and rescanning everything in rescanned, and by the original
+ * algorithm in reference */
+typedef struct _InfinotedReplacerCheckCase InfinotedReplacerCheckCase;
+struct _InfinotedReplacerCheckCase {
+  InfinotedReplacerCheckSource* source;
+  InfinotedPluginReplacerTable* table;
+  InfTextBuffer* buffer;
+  InfinotedPluginReplacerScratch scratch;
+  InfTextBuffer* rescanned;
+  InfinotedPluginReplacerScratch rescanned_scratch;
+  InfTextBuffer* reference;
+  guint n_runs;
+};
+
+/* Returns a number below n. Fuzzer input which has been used up reads as
+ * zeroes. */
+static guint
+infinoted_replacer_check_choose(InfinotedReplacerCheckSource* source,
+                                guint n)
+{
+  guint value;
+
+  if(n <= 1)
+    return 0;
+
+  if(source->rand != NULL)
+    return g_rand_int_range(source->rand, 0, n);
+
+  value = 0;
+  if(source->pos < source->size)
+    value = source->data[source->pos++];
+  if(n > 256 && source->pos < source->size)
+    value = (value << 8) | source->data[source->pos++];
+
+  return value % n;
+}
+
+static const gchar*
+infinoted_replacer_check_choose_symbol(InfinotedReplacerCheckSource* source)
+{
+  return INFINOTED_REPLACER_CHECK_SYMBOLS[
+    infinoted_replacer_check_choose(
+      source,
+      G_N_ELEMENTS(INFINOTED_REPLACER_CHECK_SYMBOLS)
+    )
+  ];
+}
+
+static void
+infinoted_replacer_check_append_json(GString* json,
+                                     const gchar* str)
+{
+  g_string_append_c(json, '"');
+  for(; *str != '\0'; ++str)
+  {
+    if(*str == '"' || *str == '\\')
+      g_string_append_c(json, '\\');
+
+    if(*str == '\n')
+      g_string_append(json, "\\n");
+    else
+      g_string_append_c(json, *str);
+  }
+  g_string_append_c(json, '"');
+}
+
+/* Appends either a symbol, a key of the table or, with partial set, the
+ * beginning or the end of a key, so that edits can complete keys and
+ * split them */
+static void
+infinoted_replacer_check_append_piece(InfinotedReplacerCheckCase* check,
+                                      GString* text,
+                                      gboolean partial)
+{
+  const InfinotedPluginReplacerRule* rule;
+  const gchar* key;
+  const gchar* split;
+  guint n_rules;
+  guint i;
+
+  n_rules = infinoted_plugin_replacer_table_get_n_rules(check->table);
+  if(n_rules == 0 || infinoted_replacer_check_choose(check->source, 3) != 0)
+  {
+    g_string_append(
+      text,
+      infinoted_replacer_check_choose_symbol(check->source)
+    );
+
+    return;
+  }
+
+  rule = infinoted_plugin_replacer_table_get_rule(
+    check->table,
+    infinoted_replacer_check_choose(check->source, n_rules)
+  );
+
+  key = infinoted_plugin_replacer_table_get_key(check->table, rule);
+  if(!partial || rule->key_ulen < 2)
+  {
+    g_string_append_len(text, key, rule->key_slen);
+    return;
+  }
+
+  i = 1 + infinoted_replacer_check_choose(check->source, rule->key_ulen - 1);
+  split = g_utf8_offset_to_pointer(key, i);
+  if(infinoted_replacer_check_choose(check->source, 2) == 0)
+    g_string_append_len(text, key, split - key);
+  else
+    g_string_append(text, split);
+}
+
+/* Makes a table of prefix-free keys. Values are made of symbols and keys:
+ * of later rules only (nested macros), of any rule, or none at all, so
+ * that there are tables with stable and with unstable rules. Some values
+ * are empty, some are not strings. */
+static GString*
+infinoted_replacer_check_make_json(InfinotedReplacerCheckSource* source)
+{
+  gchar* keys[INFINOTED_REPLACER_CHECK_MAX_RULES];
+  GString* key;
+  GString* value;
+  GString* json;
+  gboolean marked;
+  gboolean empty;
+  guint kind;
+  guint n_attempts;
+  guint n_rules;
+  guint len;
+  guint i;
+  guint j;
+
+  /* With marked keys, LaTeX style, values only contain a key when they
+   * are made to, so that the table is mostly stable */
+  marked = infinoted_replacer_check_choose(source, 2) == 0;
+  kind = infinoted_replacer_check_choose(source, 3);
+  /* An empty value can join the text around it into a key, so a single
+   * one makes the table unstable */
+  empty = infinoted_replacer_check_choose(source, 4) == 0;
+
+  n_attempts = 1 + infinoted_replacer_check_choose(
+    source,
+    INFINOTED_REPLACER_CHECK_MAX_RULES
+  );
+
+  n_rules = 0;
+  key = g_string_new(NULL);
+  for(i = 0; i < n_attempts; ++i)
+  {
+    g_string_assign(key, marked ? "\\" : "");
+    len = 1 + infinoted_replacer_check_choose(source, 3);
+    for(j = 0; j < len; ++j)
+      g_string_append(key, infinoted_replacer_check_choose_symbol(source));
+
+    for(j = 0; j < n_rules; ++j)
+    {
+      if(strncmp(keys[j], key->str, MIN(strlen(keys[j]), key->len)) == 0)
+        break;
+    }
+
+    if(j == n_rules)
+      keys[n_rules++] = g_strdup(key->str);
+  }
+  g_string_free(key, TRUE);
+
+  json = g_string_new("{");
+  for(i = 0; i < n_rules; ++i)
+  {
+    if(i > 0)
+      g_string_append(json, ",\n");
+
+    infinoted_replacer_check_append_json(json, keys[i]);
+    g_string_append(json, ": ");
+
+    if(infinoted_replacer_check_choose(source, 16) == 0)
+    {
+      g_string_append(json, "1");
+      continue;
+    }
+
+    value = g_string_new(NULL);
+    if(empty)
+      len = infinoted_replacer_check_choose(source, 5);
+    else
+      len = 1 + infinoted_replacer_check_choose(source, 4);
+
+    for(j = 0; j < len; ++j)
+    {
+      if(kind == 1 && i + 1 < n_rules &&
+         infinoted_replacer_check_choose(source, 2) == 0)
+      {
+        g_string_append(
+          value,
+          keys[i + 1 + infinoted_replacer_check_choose(source, n_rules - i - 1)]
+        );
+      }
+      else if(kind == 2 && infinoted_replacer_check_choose(source, 2) == 0)
+      {
+        g_string_append(
+          value,
+          keys[infinoted_replacer_check_choose(source, n_rules)]
+        );
+      }
+      else if(marked)
+      {
+        g_string_append(
+          value,
+          INFINOTED_REPLACER_CHECK_VALUE_SYMBOLS[
+            infinoted_replacer_check_choose(
+              source,
+              G_N_ELEMENTS(INFINOTED_REPLACER_CHECK_VALUE_SYMBOLS)
+            )
+          ]
+        );
+      }
+      else
+      {
+        g_string_append(value, infinoted_replacer_check_choose_symbol(source));
+      }
+    }
+
+    infinoted_replacer_check_append_json(json, value->str);
+    g_string_free(value, TRUE);
+  }
+  g_string_append(json, "}\n");
+
+  for(i = 0; i < n_rules; ++i)
+    g_free(keys[i]);
+
+  return json;
+}
+
+static InfinotedPluginReplacerTable*
+infinoted_replacer_check_load_json(const GString* json,
+                                   GError** error)
+{
+  InfinotedPluginReplacerTable* table;
+  gchar* filename;
+  gint fd;
+
+  fd = g_file_open_tmp("infinoted-replacer-check-XXXXXX.json", &filename,
+                       error);
+  if(fd == -1)
+    return NULL;
+
+  close(fd);
+
+  table = NULL;
+  if(g_file_set_contents(filename, json->str, json->len, error))
+    table = infinoted_plugin_replacer_table_load(filename, FALSE, error);
+
+  g_unlink(filename);
+  g_free(filename);
+  return table;
+}
+
+static void
+infinoted_replacer_check_insert(InfinotedReplacerCheckCase* check,
+                                guint pos,
+                                const GString* text)
+{
+  InfTextChunk* chunk;
+  glong len;
+
+  len = g_utf8_strlen(text->str, text->len);
+  chunk = inf_text_chunk_new("UTF-8");
+  inf_text_chunk_insert_text(chunk, 0, text->str, text->len, len, 0);
+
+  infinoted_plugin_replacer_scratch_text_inserted(&check->scratch, pos, chunk);
+  inf_text_buffer_insert_chunk(check->buffer, pos, chunk, NULL);
+  infinoted_plugin_replacer_scratch_text_inserted(
+    &check->rescanned_scratch,
+    pos,
+    chunk
+  );
+  inf_text_buffer_insert_chunk(check->rescanned, pos, chunk, NULL);
+  inf_text_buffer_insert_text(check->reference, pos, text->str, text->len,
+                              len, NULL);
+
+  inf_text_chunk_free(chunk);
+}
+
+static void
+infinoted_replacer_check_erase(InfinotedReplacerCheckCase* check,
+                               guint pos,
+                               guint len)
+{
+  InfTextChunk* chunk;
+
+  chunk = inf_text_buffer_get_slice(check->buffer, pos, len);
+
+  infinoted_plugin_replacer_scratch_text_erased(&check->scratch, pos, chunk);
+  inf_text_buffer_erase_text(check->buffer, pos, len, NULL);
+  infinoted_plugin_replacer_scratch_text_erased(
+    &check->rescanned_scratch,
+    pos,
+    chunk
+  );
+  inf_text_buffer_erase_text(check->rescanned, pos, len, NULL);
+  inf_text_buffer_erase_text(check->reference, pos, len, NULL);
+
+  inf_text_chunk_free(chunk);
+}
+
+/* Returns whether buffer and expected hold the same text. The texts are
+ * printed if they do not, and if the operation counts differ. */
+static gboolean
+infinoted_replacer_check_compare(InfinotedReplacerCheckCase* check,
+                                 const gchar* what,
+                                 InfTextBuffer* buffer,
+                                 guint operations,
+                                 InfTextBuffer* expected,
+                                 guint expected_operations)
+{
+  InfTextChunk* chunk;
+  InfTextChunk* expected_chunk;
+  gchar* text;
+  gchar* expected_text;
+  gsize bytes;
+  gsize expected_bytes;
+  gboolean result;
+
+  chunk = inf_text_buffer_get_slice(
+    buffer,
+    0,
+    inf_text_buffer_get_length(buffer)
+  );
+
+  expected_chunk = inf_text_buffer_get_slice(
+    expected,
+    0,
+    inf_text_buffer_get_length(expected)
+  );
+
+  text = inf_text_chunk_get_text(chunk, &bytes);
+  expected_text = inf_text_chunk_get_text(expected_chunk, &expected_bytes);
+
+  result = operations == expected_operations &&
+    bytes == expected_bytes &&
+    memcmp(text, expected_text, bytes) == 0;
+
+  if(!result)
+  {
+    g_printerr(
+      "Run %u: %s made %u operations resulting in\n\"%.*s\"\n"
+      "instead of %u operations resulting in\n\"%.*s\"\n",
+      check->n_runs,
+      what,
+      operations,
+      (int)bytes,
+      text,
+      expected_operations,
+      (int)expected_bytes,
+      expected_text
+    );
+  }
+
+  g_free(text);
+  g_free(expected_text);
+  inf_text_chunk_free(chunk);
+  inf_text_chunk_free(expected_chunk);
+  return result;
+}
+
+static gboolean
+infinoted_replacer_check_run(InfinotedReplacerCheckCase* check)
+{
+  guint operations;
+  guint rescanned_operations;
+  guint reference_operations;
+
+  operations = infinoted_plugin_replacer_core_run(
+    &check->scratch,
+    check->table,
+    TRUE,
+    check->buffer,
+    NULL
+  );
+
+  rescanned_operations = infinoted_plugin_replacer_core_run(
+    &check->rescanned_scratch,
+    check->table,
+    FALSE,
+    check->rescanned,
+    NULL
+  );
+
+  reference_operations = infinoted_plugin_replacer_core_run_reference(
+    check->table,
+    check->reference,
+    NULL
+  );
+
+  ++check->n_runs;
+  return infinoted_replacer_check_compare(
+    check,
+    "full rescan",
+    check->rescanned,
+    rescanned_operations,
+    check->reference,
+    reference_operations
+  ) && infinoted_replacer_check_compare(
+    check,
+    "incremental run",
+    check->buffer,
+    operations,
+    check->rescanned,
+    rescanned_operations
+  );
+}
+
+/* Applies a random edit to the document */
+static void
+infinoted_replacer_check_edit(InfinotedReplacerCheckCase* check)
+{
+  GString* text;
+  guint length;
+  guint pos;
+  guint len;
+  guint i;
+
+  length = inf_text_buffer_get_length(check->buffer);
+  if(length == 0 || infinoted_replacer_check_choose(check->source, 2) == 0)
+  {
+    text = g_string_new(NULL);
+    len = 1 + infinoted_replacer_check_choose(check->source, 3);
+    for(i = 0; i < len; ++i)
+      infinoted_replacer_check_append_piece(check, text, TRUE);
+
+    pos = infinoted_replacer_check_choose(check->source, length + 1);
+    infinoted_replacer_check_insert(check, pos, text);
+    g_string_free(text, TRUE);
+  }
+  else
+  {
+    pos = infinoted_replacer_check_choose(check->source, length);
+    len = 1 + infinoted_replacer_check_choose(
+      check->source,
+      MIN(length - pos, 8)
+    );
+
+    infinoted_replacer_check_erase(check, pos, len);
+  }
+}
+
+/* Checks a random table on a random document being edited. Returns FALSE
+ * and prints the table if a run goes wrong. */
+static gboolean
+infinoted_replacer_check_case(InfinotedReplacerCheckSource* source)
+{
+  InfinotedReplacerCheckCase check;
+  GString* json;
+  GString* text;
+  GError* error;
+  gboolean result;
+  guint n_batches;
+  guint n_edits;
+  guint len;
+  guint i;
+  guint j;
+
+  json = infinoted_replacer_check_make_json(source);
+
+  error = NULL;
+  memset(&check, 0, sizeof(check));
+  check.source = source;
+  check.table = infinoted_replacer_check_load_json(json, &error);
+  if(check.table == NULL)
+  {
+    g_printerr("%s\nin table:\n%s", error->message, json->str);
+    g_error_free(error);
+    g_string_free(json, TRUE);
+    return FALSE;
+  }
+
+  check.buffer = INF_TEXT_BUFFER(inf_text_default_buffer_new("UTF-8"));
+  check.rescanned = INF_TEXT_BUFFER(inf_text_default_buffer_new("UTF-8"));
+  check.reference = INF_TEXT_BUFFER(inf_text_default_buffer_new("UTF-8"));
+  infinoted_plugin_replacer_scratch_init(&check.scratch);
+  infinoted_plugin_replacer_scratch_init(&check.rescanned_scratch);
+
+  text = g_string_new(NULL);
+  len = infinoted_replacer_check_choose(source, 200);
+  for(i = 0; i < len; ++i)
+    infinoted_replacer_check_append_piece(&check, text, FALSE);
+  if(text->len > 0)
+    infinoted_replacer_check_insert(&check, 0, text);
+  g_string_free(text, TRUE);
+
+  result = infinoted_replacer_check_run(&check);
+
+  n_batches = 1 + infinoted_replacer_check_choose(source, 40);
+  for(i = 0; i < n_batches && result; ++i)
+  {
+    if(inf_text_buffer_get_length(check.buffer) >
+       INFINOTED_REPLACER_CHECK_MAX_LENGTH)
+    {
+      break;
+    }
+
+    /* The edits made between two runs */
+    n_edits = 1 + infinoted_replacer_check_choose(source, 4);
+    for(j = 0; j < n_edits; ++j)
+      infinoted_replacer_check_edit(&check);
+
+    result = infinoted_replacer_check_run(&check);
+  }
+
+  if(!result)
+    g_printerr("with table:\n%s", json->str);
+
+  infinoted_plugin_replacer_scratch_release(&check.scratch);
+  infinoted_plugin_replacer_scratch_release(&check.rescanned_scratch);
+  g_object_unref(check.buffer);
+  g_object_unref(check.rescanned);
+  g_object_unref(check.reference);
+  infinoted_plugin_replacer_table_free(check.table);
+  g_string_free(json, TRUE);
+
+  return result;
+}
+
+#ifdef INFINOTED_REPLACER_CHECK_FUZZ
+int
+LLVMFuzzerTestOneInput(const uint8_t* data,
+                       size_t size)
+{
+  InfinotedReplacerCheckSource source;
+
+  source.rand = NULL;
+  source.data = data;
+  source.size = size;
+  source.pos = 0;
+
+  if(!infinoted_replacer_check_case(&source))
+    abort();
+
+  return 0;
+}
+#else
+static gint check_cases = 500;
+static gint check_seed = 1;
+
+static const GOptionEntry INFINOTED_REPLACER_CHECK_OPTIONS[] = {
+  {
+    "cases", 'n', 0, G_OPTION_ARG_INT, &check_cases,
+    "Number of cases to check (default 500)", "N"
+  }, {
+    "seed", 's', 0, G_OPTION_ARG_INT, &check_seed,
+    "Seed of the first case; case i uses SEED + i (default 1)", "SEED"
+  }, {
+    NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL
+  }
+};
+
+int
+main(int argc,
+     char* argv[])
+{
+  InfinotedReplacerCheckSource source;
+  GOptionContext* context;
+  GError* error;
+  guint i;
+
+  error = NULL;
+  context = g_option_context_new(NULL);
+  g_option_context_set_summary(
+    context,
+    "Checks the replacer against the original algorithm on random replace "
+    "tables, documents and edits."
+  );
+
+  g_option_context_add_main_entries(
+    context,
+    INFINOTED_REPLACER_CHECK_OPTIONS,
+    NULL
+  );
+
+  if(!g_option_context_parse(context, &argc, &argv, &error))
+  {
+    g_printerr("%s\n", error->message);
+    g_error_free(error);
+    g_option_context_free(context);
+    return 1;
+  }
+
+  g_option_context_free(context);
+
+  memset(&source, 0, sizeof(source));
+  source.rand = g_rand_new_with_seed(check_seed);
+
+  for(i = 0; i < (guint)check_cases; ++i)
+  {
+    g_rand_set_seed(source.rand, check_seed + i);
+    if(!infinoted_replacer_check_case(&source))
+    {
+      g_printerr(
+        "Case %u failed; check it alone with --seed=%u --cases=1\n",
+        i,
+        check_seed + i
+      );
+
+      g_rand_free(source.rand);
+      return 1;
+    }
+  }
+
+  g_print("%d cases passed\n", check_cases);
+  g_rand_free(source.rand);
+  return 0;
+}
+#endif
+
+/* vim:set et sw=2 ts=2: */
@@ -0,0 +1,510 @@
+/*
+ * infinoted-plugin-replacer - a real-time replacer for text sessions
+ * on an infinoted server.
+ * Copyright (C) 2016 Pietro Brenna <pietrobrenna@zoho.com>
+ * Copyright (C) 2016 Alessandro Bregoli <>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+*/
+
+/* Feeds a recording made with the record-dir option of the replacer plugin
+ * through the replacer, without a server, and reports how it performed. */
+
+#include "infinoted-plugin-replacer-core.h"
+#include "infinoted-plugin-replacer-record.h"
+#include "infinoted-plugin-replacer-table.h"
+
+#include <libinftext/inf-text-default-buffer.h>
+
+#include <string.h>
+
+typedef struct _InfinotedReplacerReplay InfinotedReplacerReplay;
+struct _InfinotedReplacerReplay {
+  InfinotedPluginReplacerTable* table;
+  InfTextBuffer* buffer;
+  InfinotedPluginReplacerScratch scratch;
+  gboolean incremental;
+  gboolean reference;
+  gint64 pending_since; /* first edit since the last run, or 0 */
+
+  guint64 n_inserts;
+  guint64 inserted; /* characters */
+  guint64 n_erases;
+  guint64 erased; /* characters */
+  guint64 n_snapshots;
+  guint64 n_runs;
+  guint64 n_disabled_runs;
+  guint64 operations;
+  gint64 run_time_total;
+  InfinotedPluginReplacerLatency run_time;
+  InfinotedPluginReplacerLatency latency;
+};
+
+static gboolean replay_realtime = FALSE;
+static gboolean replay_reference = FALSE;
+static gboolean replay_incremental = TRUE;
+static gchar* replay_output = NULL;
+
+static const GOptionEntry INFINOTED_REPLACER_REPLAY_OPTIONS[] = {
+  {
+    "realtime", 'r', 0, G_OPTION_ARG_NONE, &replay_realtime,
+    "Replay the events with their recorded timing instead of as fast as "
+    "possible", NULL
+  }, {
+    "reference", 0, 0, G_OPTION_ARG_NONE, &replay_reference,
+    "Do every run with the original algorithm", NULL
+  }, {
+    "no-incremental", 0, G_OPTION_FLAG_REVERSE, G_OPTION_ARG_NONE,
+    &replay_incremental,
+    "Rescan the document as a whole in every run", NULL
+  }, {
+    "output", 'o', 0, G_OPTION_ARG_FILENAME, &replay_output,
+    "Write the document at the end of the recording to FILE", "FILE"
+  }, {
+    NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL
+  }
+};
+
+/* Replaces the document by the snapshot. The replacer reads it as a whole
+ * in the next run, as the plugin does after its user has joined again. */
+static void
+infinoted_replacer_replay_snapshot(
+  InfinotedReplacerReplay* replay,
+  const InfinotedPluginReplacerRecordEvent* event)
+{
+  if(inf_text_buffer_get_length(replay->buffer) > 0)
+  {
+    inf_text_buffer_erase_text(
+      replay->buffer,
+      0,
+      inf_text_buffer_get_length(replay->buffer),
+      NULL
+    );
+  }
+
+  if(event->len > 0)
+  {
+    inf_text_buffer_insert_text(
+      replay->buffer,
+      0,
+      event->text,
+      event->bytes,
+      event->len,
+      NULL
+    );
+  }
+
+  replay->scratch.synced = FALSE;
+  replay->scratch.dirty_begin = G_MAXUINT;
+  replay->scratch.dirty_end = 0;
+  ++replay->n_snapshots;
+}
+
+static void
+infinoted_replacer_replay_insert(
+  InfinotedReplacerReplay* replay,
+  const InfinotedPluginReplacerRecordEvent* event)
+{
+  InfTextChunk* chunk;
+
+  chunk = inf_text_chunk_new("UTF-8");
+  inf_text_chunk_insert_text(
+    chunk,
+    0,
+    event->text,
+    event->bytes,
+    event->len,
+    event->user
+  );
+
+  infinoted_plugin_replacer_scratch_text_inserted(
+    &replay->scratch,
+    event->pos,
+    chunk
+  );
+
+  inf_text_buffer_insert_chunk(replay->buffer, event->pos, chunk, NULL);
+  inf_text_chunk_free(chunk);
+
+  ++replay->n_inserts;
+  replay->inserted += event->len;
+}
+
+static void
+infinoted_replacer_replay_erase(
+  InfinotedReplacerReplay* replay,
+  const InfinotedPluginReplacerRecordEvent* event)
+{
+  InfTextChunk* chunk;
+
+  chunk = inf_text_buffer_get_slice(replay->buffer, event->pos, event->len);
+
+  infinoted_plugin_replacer_scratch_text_erased(
+    &replay->scratch,
+    event->pos,
+    chunk
+  );
+
+  inf_text_buffer_erase_text(replay->buffer, event->pos, event->len, NULL);
+  inf_text_chunk_free(chunk);
+
+  ++replay->n_erases;
+  replay->erased += event->len;
+}
+
+static void
+infinoted_replacer_replay_run(InfinotedReplacerReplay* replay)
+{
+  gint64 start;
+  gint64 end;
+
+  if(!infinoted_plugin_replacer_core_check_enabled(&replay->scratch,
+                                                   replay->buffer))
+  {
+    replay->scratch.synced = FALSE;
+    replay->pending_since = 0;
+    ++replay->n_disabled_runs;
+    return;
+  }
+
+  start = g_get_monotonic_time();
+
+  if(replay->reference)
+  {
+    replay->operations += infinoted_plugin_replacer_core_run_reference(
+      replay->table,
+      replay->buffer,
+      NULL
+    );
+  }
+  else
+  {
+    replay->operations += infinoted_plugin_replacer_core_run(
+      &replay->scratch,
+      replay->table,
+      replay->incremental,
+      replay->buffer,
+      NULL
+    );
+
+    replay->scratch.high_water = MAX(
+      replay->scratch.high_water,
+      infinoted_plugin_replacer_scratch_get_size(&replay->scratch)
+    );
+  }
+
+  end = g_get_monotonic_time();
+
+  ++replay->n_runs;
+  replay->run_time_total += end - start;
+  infinoted_plugin_replacer_latency_add(&replay->run_time, end - start);
+
+  if(replay->pending_since != 0)
+  {
+    infinoted_plugin_replacer_latency_add(
+      &replay->latency,
+      end - replay->pending_since
+    );
+
+    replay->pending_since = 0;
+  }
+}
+
+/* Checks that an edit fits the document. It does not if the recording was
+ * made with a different replace table, since the replacements made by the
+ * runs are not recorded but done again. */
+static gboolean
+infinoted_replacer_replay_check_edit(
+  InfinotedReplacerReplay* replay,
+  const InfinotedPluginReplacerRecordEvent* event,
+  GError** error)
+{
+  guint length;
+
+  length = inf_text_buffer_get_length(replay->buffer);
+  if(event->pos > length ||
+     (event->type == INFINOTED_PLUGIN_REPLACER_RECORD_ERASE &&
+      event->len > length - event->pos))
+  {
+    g_set_error(
+      error,
+      INFINOTED_PLUGIN_REPLACER_RECORD_ERROR,
+      INFINOTED_PLUGIN_REPLACER_RECORD_ERROR_CORRUPT,
+      "Edit at %u of %u characters at %.3f s does not fit the document of "
+      "%u characters; was the recording made with another replace table?",
+      event->pos,
+      event->len,
+      event->time / (double)G_USEC_PER_SEC,
+      length
+    );
+
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static gboolean
+infinoted_replacer_replay_file(InfinotedReplacerReplay* replay,
+                               const gchar* filename,
+                               GError** error)
+{
+  InfinotedPluginReplacerRecordReader* reader;
+  InfinotedPluginReplacerRecordEvent event;
+  GError* local_error;
+  gint64 start;
+  gint64 wait;
+
+  reader = infinoted_plugin_replacer_record_reader_new(filename, error);
+  if(reader == NULL)
+    return FALSE;
+
+  local_error = NULL;
+  start = g_get_monotonic_time();
+
+  while(infinoted_plugin_replacer_record_reader_next(reader, &event,
+                                                     &local_error))
+  {
+    if(replay_realtime)
+    {
+      wait = start + event.time - g_get_monotonic_time();
+      if(wait > 0)
+        g_usleep(wait);
+    }
+
+    switch(event.type)
+    {
+    case INFINOTED_PLUGIN_REPLACER_RECORD_SNAPSHOT:
+      infinoted_replacer_replay_snapshot(replay, &event);
+      break;
+    case INFINOTED_PLUGIN_REPLACER_RECORD_INSERT:
+    case INFINOTED_PLUGIN_REPLACER_RECORD_ERASE:
+      if(!infinoted_replacer_replay_check_edit(replay, &event, &local_error))
+        break;
+
+      if(replay->pending_since == 0)
+        replay->pending_since = g_get_monotonic_time();
+
+      if(event.type == INFINOTED_PLUGIN_REPLACER_RECORD_INSERT)
+        infinoted_replacer_replay_insert(replay, &event);
+      else
+        infinoted_replacer_replay_erase(replay, &event);
+      break;
+    case INFINOTED_PLUGIN_REPLACER_RECORD_RUN:
+      infinoted_replacer_replay_run(replay);
+      break;
+    default:
+      g_assert_not_reached();
+      break;
+    }
+
+    if(local_error != NULL)
+      break;
+  }
+
+  infinoted_plugin_replacer_record_reader_free(reader);
+
+  if(local_error != NULL)
+  {
+    g_propagate_error(error, local_error);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static void
+infinoted_replacer_replay_print_latency(
+  const gchar* name,
+  const InfinotedPluginReplacerLatency* latency)
+{
+  if(latency->total == 0)
+    return;
+
+  g_print(
+    "  %s: p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+    name,
+    infinoted_plugin_replacer_latency_percentile(latency, 50) / 1000.0,
+    infinoted_plugin_replacer_latency_percentile(latency, 90) / 1000.0,
+    infinoted_plugin_replacer_latency_percentile(latency, 99) / 1000.0,
+    latency->max / 1000.0
+  );
+}
+
+static void
+infinoted_replacer_replay_report(InfinotedReplacerReplay* replay,
+                                 gint64 elapsed)
+{
+  gdouble seconds;
+  gdouble run_seconds;
+  guint64 events;
+
+  seconds = MAX(elapsed, 1) / (gdouble)G_USEC_PER_SEC;
+  run_seconds = MAX(replay->run_time_total, 1) / (gdouble)G_USEC_PER_SEC;
+  events = replay->n_inserts + replay->n_erases + replay->n_snapshots +
+    replay->n_runs + replay->n_disabled_runs;
+
+  g_print(
+    "Replayed %" G_GUINT64_FORMAT " events in %.3f s (%.0f events/s)\n",
+    events,
+    seconds,
+    events / seconds
+  );
+
+  g_print(
+    "  edits: %" G_GUINT64_FORMAT " insertions of %" G_GUINT64_FORMAT
+    " characters, %" G_GUINT64_FORMAT " erasures of %" G_GUINT64_FORMAT
+    " characters, %" G_GUINT64_FORMAT " snapshots\n",
+    replay->n_inserts,
+    replay->inserted,
+    replay->n_erases,
+    replay->erased,
+    replay->n_snapshots
+  );
+
+  g_print(
+    "  runs: %" G_GUINT64_FORMAT " doing %" G_GUINT64_FORMAT " operations "
+    "in %.3f s (%.0f edited characters/s), %" G_GUINT64_FORMAT
+    " skipped while the replacer was off\n",
+    replay->n_runs,
+    replay->operations,
+    run_seconds,
+    (replay->inserted + replay->erased) / run_seconds,
+    replay->n_disabled_runs
+  );
+
+  infinoted_replacer_replay_print_latency("run time", &replay->run_time);
+
+  /* Without the recorded timing, edits are not waiting for anything */
+  if(replay_realtime)
+    infinoted_replacer_replay_print_latency("latency", &replay->latency);
+
+  g_print(
+    "  document: %u characters, scratch high-water mark: %" G_GSIZE_FORMAT
+    " bytes\n",
+    inf_text_buffer_get_length(replay->buffer),
+    replay->scratch.high_water
+  );
+}
+
+static gboolean
+infinoted_replacer_replay_write_output(InfinotedReplacerReplay* replay,
+                                       const gchar* filename,
+                                       GError** error)
+{
+  InfTextChunk* chunk;
+  gchar* text;
+  gsize bytes;
+  gboolean result;
+
+  chunk = inf_text_buffer_get_slice(
+    replay->buffer,
+    0,
+    inf_text_buffer_get_length(replay->buffer)
+  );
+
+  text = inf_text_chunk_get_text(chunk, &bytes);
+  result = g_file_set_contents(filename, text, bytes, error);
+
+  g_free(text);
+  inf_text_chunk_free(chunk);
+  return result;
+}
+
+int
+main(int argc,
+     char* argv[])
+{
+  InfinotedReplacerReplay replay;
+  GOptionContext* context;
+  GError* error;
+  gint64 start;
+  gboolean result;
+
+  error = NULL;
+  context = g_option_context_new("TABLE RECORDING");
+  g_option_context_set_summary(
+    context,
+    "Replays a recording of the edits of a document, made with the "
+    "record-dir option of the replacer plugin, using the replace table "
+    "the recording was made with."
+  );
+
+  g_option_context_add_main_entries(
+    context,
+    INFINOTED_REPLACER_REPLAY_OPTIONS,
+    NULL
+  );
+
+  if(!g_option_context_parse(context, &argc, &argv, &error))
+  {
+    g_printerr("%s\n", error->message);
+    g_error_free(error);
+    g_option_context_free(context);
+    return 1;
+  }
+
+  g_option_context_free(context);
+
+  if(argc != 3)
+  {
+    g_printerr("Usage: %s [OPTION...] TABLE RECORDING\n", argv[0]);
+    return 1;
+  }
+
+  memset(&replay, 0, sizeof(replay));
+  replay.incremental = replay_incremental;
+  replay.reference = replay_reference;
+
+  replay.table = infinoted_plugin_replacer_table_load(argv[1], FALSE, &error);
+  if(replay.table == NULL)
+  {
+    g_printerr("%s\n", error->message);
+    g_error_free(error);
+    return 1;
+  }
+
+  replay.buffer = INF_TEXT_BUFFER(inf_text_default_buffer_new("UTF-8"));
+  infinoted_plugin_replacer_scratch_init(&replay.scratch);
+
+  start = g_get_monotonic_time();
+  result = infinoted_replacer_replay_file(&replay, argv[2], &error);
+  infinoted_replacer_replay_report(&replay, g_get_monotonic_time() - start);
+
+  if(result && replay_output != NULL)
+  {
+    result = infinoted_replacer_replay_write_output(
+      &replay,
+      replay_output,
+      &error
+    );
+  }
+
+  if(!result)
+  {
+    g_printerr("%s\n", error->message);
+    g_error_free(error);
+  }
+
+  infinoted_plugin_replacer_scratch_release(&replay.scratch);
+  g_object_unref(replay.buffer);
+  infinoted_plugin_replacer_table_free(replay.table);
+  g_free(replay_output);
+
+  return result ? 0 : 1;
+}
+
+/* vim:set et sw=2 ts=2: */